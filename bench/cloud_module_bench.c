@@ -0,0 +1,396 @@
+/*
+** Copyright (C) 2014 DAISUKE Ikeda
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation; either version 2 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+**/
+
+/*
+ * Benchmark of the item handlers of cloud_module.c against the stub libdeltacloud in deltacloud_stub.c.
+ *
+ * The module is included so cloud_mem can be inspected. It starts its collectors as in Zabbix, the
+ * benchmark waits until they have cached the synthetic fleet, then calls each handler the way the
+ * pollers do and reports throughput, latency and cloud_mem usage.
+ *
+ * With -r it runs the given number of metric discovery cycles instead and fails if the metric sets,
+ * cloud_mem usage or the metric lookup time grow with them.
+ */
+
+#define CONFIG_FILE "cloud_module_bench.conf"
+
+#include "../cloud_module.c"
+
+/* referenced by the Zabbix common library */
+const char	*progname = "cloud_module_bench";
+const char	title_message[] = "Benchmark of the cloud module item handlers";
+const char	usage_message[] = "[-i instances] [-m metrics] [-a addresses] [-n calls] [-f collectors] [-r cycles]";
+const char	*help_message[] = {NULL};
+
+extern int	bench_fleet_instances;
+extern int	bench_fleet_metrics;
+extern int	bench_fleet_addresses;
+
+#define BENCH_URL	"http://localhost:3000/api"
+#define BENCH_KEY	"BENCHKEY"
+#define BENCH_SECRET	"BENCHSECRET"
+#define BENCH_DRIVER	"ec2"
+#define BENCH_PROVIDER	"ap-northeast-1"
+#define BENCH_TIMEOUT	300
+/* the metric lookup time of the last cycles may exceed the one of the first cycles by this factor */
+#define BENCH_LOOKUP_SLOWDOWN	2
+
+static int	bench_calls = 10000;
+static int	bench_collectors = 2;
+static int	bench_cycles = 0;
+
+static int	bench_compare_double(const void *d1, const void *d2)
+{
+	const double	*v1 = (const double *)d1;
+	const double	*v2 = (const double *)d2;
+
+	if (*v1 < *v2)
+		return -1;
+
+	return *v1 > *v2 ? 1 : 0;
+}
+
+/* call a handler with the connection parameters followed by the given ones */
+static int	bench_call(int (*handler)(AGENT_REQUEST *, AGENT_RESULT *), const char *param1, const char *param2,
+		const char *param3)
+{
+	AGENT_REQUEST	request;
+	AGENT_RESULT	result;
+	char		*params[8] = {BENCH_URL, BENCH_KEY, BENCH_SECRET, BENCH_DRIVER, BENCH_PROVIDER};
+	int		ret;
+
+	memset(&request, 0, sizeof(request));
+	request.params = params;
+	request.nparam = 5;
+
+	if (NULL != param1)
+		params[request.nparam++] = (char *)param1;
+	if (NULL != param2)
+		params[request.nparam++] = (char *)param2;
+	if (NULL != param3)
+		params[request.nparam++] = (char *)param3;
+
+	memset(&result, 0, sizeof(result));
+	ret = handler(&request, &result);
+
+	free(result.str);
+	free(result.text);
+	free(result.msg);
+
+	return ret;
+}
+
+static const char	*bench_instance_id(int i)
+{
+	static char	instance_id[32];
+
+	zbx_snprintf(instance_id, sizeof(instance_id), "i-%08x", i % bench_fleet_instances);
+
+	return instance_id;
+}
+
+/* check whether the collectors have cached the instances and metric_infos_num metric sets */
+static int	bench_collected(int metric_infos_num)
+{
+	zbx_deltacloud_service_t	*service;
+	zbx_deltacloud_metric_info_t	*metric_info;
+	zbx_hashset_iter_t		iter;
+	int				ret = FAIL;
+
+	cloud_rdlock();
+
+	if (NULL != (service = cloud_service_find(BENCH_URL, BENCH_KEY, BENCH_SECRET, BENCH_DRIVER,
+			BENCH_PROVIDER)) && 0 != service->lastcheck)
+	{
+		zbx_hashset_iter_reset(&service->metric_infos, &iter);
+		while (NULL != (metric_info = zbx_hashset_iter_next(&iter)))
+		{
+			if (0 != metric_info->lastcheck)
+				metric_infos_num--;
+		}
+
+		if (0 >= metric_infos_num)
+			ret = SUCCEED;
+	}
+
+	cloud_rdunlock();
+
+	return ret;
+}
+
+static int	bench_wait_collected(int metric_infos_num)
+{
+	double	start = zbx_time();
+
+	while (SUCCEED != bench_collected(metric_infos_num))
+	{
+		if (zbx_time() - start > BENCH_TIMEOUT)
+			return FAIL;
+
+		usleep(10000);
+	}
+
+	return SUCCEED;
+}
+
+static void	bench_run(const char *name, int (*handler)(AGENT_REQUEST *, AGENT_RESULT *), int with_instance,
+		const char *param2, const char *param3)
+{
+	double	*latencies, start, total = 0;
+	int	i, failed = 0;
+
+	latencies = zbx_malloc(NULL, bench_calls * sizeof(double));
+
+	for (i = 0; i < bench_calls; i++)
+	{
+		start = zbx_time();
+
+		if (SYSINFO_RET_OK != bench_call(handler, 0 != with_instance ? bench_instance_id(i) : NULL, param2,
+				param3))
+		{
+			failed++;
+		}
+
+		latencies[i] = zbx_time() - start;
+		total += latencies[i];
+	}
+
+	qsort(latencies, bench_calls, sizeof(double), bench_compare_double);
+
+	printf("%-28s %10.0f %10.1f %10.1f %10.1f %10.1f %8d\n", name, bench_calls / total,
+			total / bench_calls * 1000000, latencies[bench_calls / 2] * 1000000,
+			latencies[bench_calls * 99 / 100] * 1000000, latencies[bench_calls - 1] * 1000000, failed);
+
+	zbx_free(latencies);
+}
+
+/* return the number of metric sets of the bench service */
+static int	bench_metric_infos_num(void)
+{
+	zbx_deltacloud_service_t	*service;
+	int				metric_infos_num = 0;
+
+	cloud_rdlock();
+
+	if (NULL != (service = cloud_service_find(BENCH_URL, BENCH_KEY, BENCH_SECRET, BENCH_DRIVER,
+			BENCH_PROVIDER)))
+	{
+		metric_infos_num = service->metric_infos.num_data;
+	}
+
+	cloud_rdunlock();
+
+	return metric_infos_num;
+}
+
+/* call cloud.metric.discovery for every instance cycles times, as the pollers do over the days, and */
+/* check that the metric sets, cloud_mem usage and the cloud.metric lookup time stay flat             */
+static int	bench_regression(int cycles)
+{
+	zbx_uint64_t	used_size;
+	double		start, duration, first = 0, last = 0;
+	int		i, j, window, metric_infos_num, ret = SUCCEED;
+
+	/* compare the lookup time of the first and the last tenth of the cycles */
+	window = MAX(cycles / 10, 1);
+
+	metric_infos_num = bench_metric_infos_num();
+	used_size = cloud_mem->used_size;
+
+	for (i = 0; i < cycles; i++)
+	{
+		for (j = 0; j < bench_fleet_instances; j++)
+			bench_call(zbx_module_cloud_metric_discovery, bench_instance_id(j), NULL, NULL);
+
+		start = zbx_time();
+
+		for (j = 0; j < bench_fleet_instances; j++)
+			bench_call(zbx_module_cloud_metric, bench_instance_id(j), "CPUUtilization", "average");
+
+		duration = zbx_time() - start;
+
+		if (i < window)
+			first += duration;
+
+		if (i >= cycles - window)
+			last += duration;
+	}
+
+	first = first / window / bench_fleet_instances * 1000000;
+	last = last / window / bench_fleet_instances * 1000000;
+
+	printf("%d discovery cycles\n", cycles);
+	printf("metric sets: %d -> %d\n", metric_infos_num, bench_metric_infos_num());
+	printf("cloud_mem: " ZBX_FS_UI64 " -> " ZBX_FS_UI64 " bytes used\n", used_size, cloud_mem->used_size);
+	printf("cloud.metric: %.1f -> %.1f usec\n", first, last);
+
+	if (metric_infos_num < bench_metric_infos_num())
+	{
+		fprintf(stderr, "the metric sets grew with the discovery cycles\n");
+		ret = FAIL;
+	}
+
+	if (used_size < cloud_mem->used_size)
+	{
+		fprintf(stderr, "cloud_mem usage grew with the discovery cycles\n");
+		ret = FAIL;
+	}
+
+	if (last > first * BENCH_LOOKUP_SLOWDOWN)
+	{
+		fprintf(stderr, "cloud.metric got slower with the discovery cycles\n");
+		ret = FAIL;
+	}
+
+	return ret;
+}
+
+static int	bench_write_config(void)
+{
+	FILE	*f;
+
+	if (NULL == (f = fopen(CONFIG_FILE, "w")))
+	{
+		fprintf(stderr, "cannot create \"%s\": %s\n", CONFIG_FILE, zbx_strerror(errno));
+		return FAIL;
+	}
+
+	fprintf(f, "ModuleCloudCacheSize=1G\n");
+	fprintf(f, "ModuleCollectorForks=%d\n", bench_collectors);
+	fprintf(f, "ZabbixFile=%s\n", CONFIG_FILE);
+	fclose(f);
+
+	return SUCCEED;
+}
+
+int	main(int argc, char **argv)
+{
+	int		ch, i, ret = EXIT_FAILURE;
+	double		start;
+	zbx_uint64_t	used_size;
+
+	while (-1 != (ch = getopt(argc, argv, "i:m:a:n:f:r:")))
+	{
+		switch (ch)
+		{
+			case 'i':
+				bench_fleet_instances = atoi(optarg);
+				break;
+			case 'm':
+				bench_fleet_metrics = atoi(optarg);
+				break;
+			case 'a':
+				bench_fleet_addresses = atoi(optarg);
+				break;
+			case 'n':
+				bench_calls = atoi(optarg);
+				break;
+			case 'f':
+				bench_collectors = atoi(optarg);
+				break;
+			case 'r':
+				bench_cycles = atoi(optarg);
+				break;
+			default:
+				fprintf(stderr, "usage: %s %s\n", progname, usage_message);
+				return EXIT_FAILURE;
+		}
+	}
+
+	if (0 >= bench_fleet_instances || 0 > bench_fleet_metrics || 0 > bench_fleet_addresses || 0 >= bench_calls ||
+			0 >= bench_collectors || 0 > bench_cycles)
+	{
+		fprintf(stderr, "usage: %s %s\n", progname, usage_message);
+		return EXIT_FAILURE;
+	}
+
+	/* keep the collector and housekeeping messages out of the measurement */
+	zabbix_open_log(LOG_TYPE_SYSLOG, LOG_LEVEL_CRIT, NULL);
+
+	if (SUCCEED != bench_write_config())
+		return EXIT_FAILURE;
+
+	if (ZBX_MODULE_OK != zbx_module_init())
+	{
+		fprintf(stderr, "cannot initialize the module\n");
+		unlink(CONFIG_FILE);
+		return EXIT_FAILURE;
+	}
+
+	printf("fleet: %d instances, %d metrics and %d addresses of each kind per instance, %d collectors\n",
+			bench_fleet_instances, bench_fleet_metrics, bench_fleet_addresses, bench_collectors);
+
+	start = zbx_time();
+	bench_call(zbx_module_cloud_instance_discovery, NULL, NULL, NULL);
+
+	if (SUCCEED != bench_wait_collected(0))
+	{
+		fprintf(stderr, "instances were not collected in %d seconds\n", BENCH_TIMEOUT);
+		goto out;
+	}
+
+	printf("instances collected in %.3f sec\n", zbx_time() - start);
+
+	start = zbx_time();
+
+	for (i = 0; i < bench_fleet_instances; i++)
+		bench_call(zbx_module_cloud_metric_discovery, bench_instance_id(i), NULL, NULL);
+
+	if (SUCCEED != bench_wait_collected(bench_fleet_instances))
+	{
+		fprintf(stderr, "metrics were not collected in %d seconds\n", BENCH_TIMEOUT);
+		goto out;
+	}
+
+	printf("metrics collected in %.3f sec\n", zbx_time() - start);
+
+	used_size = cloud_mem->used_size;
+	printf("cloud_mem: " ZBX_FS_UI64 " bytes used of " ZBX_FS_UI64 ", " ZBX_FS_UI64 " bytes per instance\n\n",
+			used_size, cloud_mem->total_size, used_size / bench_fleet_instances);
+
+	if (0 != bench_cycles)
+	{
+		if (SUCCEED == bench_regression(bench_cycles))
+			ret = EXIT_SUCCESS;
+
+		goto out;
+	}
+
+	printf("%-28s %10s %10s %10s %10s %10s %8s\n", "handler (usec)", "calls/sec", "avg", "p50", "p99", "max",
+			"failed");
+
+	bench_run("cloud.instance.discovery", zbx_module_cloud_instance_discovery, 0, NULL, NULL);
+	bench_run("cloud.instance.info", zbx_module_cloud_instance_info, 1, "state", NULL);
+	bench_run("cloud.instance.info.all", zbx_module_cloud_instance_info_all, 1, NULL, NULL);
+	bench_run("cloud.metric.discovery", zbx_module_cloud_metric_discovery, 1, NULL, NULL);
+	bench_run("cloud.metric", zbx_module_cloud_metric, 1, "CPUUtilization", "average");
+	bench_run("cloud.metric.all", zbx_module_cloud_metric_all, 1, NULL, NULL);
+
+	if (used_size != cloud_mem->used_size)
+	{
+		printf("\ncloud_mem changed by %d bytes while handling items\n",
+				(int)(cloud_mem->used_size - used_size));
+	}
+
+	ret = EXIT_SUCCESS;
+out:
+	zbx_module_uninit();
+	unlink(CONFIG_FILE);
+
+	return ret;
+}
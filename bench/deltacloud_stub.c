@@ -0,0 +1,206 @@
+/*
+** Copyright (C) 2014 DAISUKE Ikeda
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation; either version 2 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+**/
+
+/* stub of the libdeltacloud calls made by cloud_module.c, returning a synthetic fleet */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libdeltacloud/libdeltacloud.h>
+
+int	bench_fleet_instances = 1000;
+int	bench_fleet_metrics = 8;
+int	bench_fleet_addresses = 2;
+
+static const char	*bench_metric_names[] = {"CPUUtilization", "DiskReadOps", "DiskWriteOps", "DiskReadBytes",
+		"DiskWriteBytes", "NetworkIn", "NetworkOut", "StatusCheckFailed"};
+#define BENCH_METRIC_NAMES_NUM	(int)(sizeof(bench_metric_names) / sizeof(bench_metric_names[0]))
+
+static char	*bench_strdup_printf(const char *fmt, int value)
+{
+	char	buffer[256];
+
+	snprintf(buffer, sizeof(buffer), fmt, value);
+
+	return strdup(buffer);
+}
+
+static struct deltacloud_address	*bench_addresses(const char *fmt, int i)
+{
+	struct deltacloud_address	*head = NULL, **tail = &head;
+	int				j;
+
+	for (j = 0; j < bench_fleet_addresses; j++)
+	{
+		*tail = calloc(1, sizeof(struct deltacloud_address));
+		(*tail)->address = bench_strdup_printf(fmt, i * bench_fleet_addresses + j);
+		tail = &(*tail)->next;
+	}
+
+	return head;
+}
+
+static void	bench_free_addresses(struct deltacloud_address *address)
+{
+	struct deltacloud_address	*next;
+
+	for (; NULL != address; address = next)
+	{
+		next = address->next;
+		free(address->address);
+		free(address);
+	}
+}
+
+int	deltacloud_initialize(struct deltacloud_api *api, char *url, char *user, char *password, char *driver,
+		char *provider)
+{
+	memset(api, 0, sizeof(struct deltacloud_api));
+	api->url = strdup(url);
+	api->initialized = 1;
+
+	return 0;
+}
+
+void	deltacloud_free(struct deltacloud_api *api)
+{
+	free(api->url);
+	api->url = NULL;
+	api->initialized = 0;
+}
+
+int	deltacloud_get_instances(struct deltacloud_api *api, struct deltacloud_instance **instances)
+{
+	struct deltacloud_instance	*head = NULL, **tail = &head, *instance;
+	int				i;
+
+	for (i = 0; i < bench_fleet_instances; i++)
+	{
+		instance = calloc(1, sizeof(struct deltacloud_instance));
+
+		instance->id = bench_strdup_printf("i-%08x", i);
+		instance->href = bench_strdup_printf("http://localhost:3000/api/instances/i-%08x", i);
+		instance->name = bench_strdup_printf("bench%d", i);
+		instance->owner_id = strdup("123456789012");
+		instance->image_id = bench_strdup_printf("ami-%08x", i % 10);
+		instance->image_href = bench_strdup_printf("http://localhost:3000/api/images/ami-%08x", i % 10);
+		instance->realm_id = bench_strdup_printf("ap-northeast-1%c", 'a' + i % 3);
+		instance->realm_href = bench_strdup_printf("http://localhost:3000/api/realms/ap-northeast-1%c",
+				'a' + i % 3);
+		instance->state = strdup(0 == i % 10 ? "STOPPED" : "RUNNING");
+		instance->launch_time = strdup("2014-06-01T00:00:00.000Z");
+		instance->hwp.href = strdup("http://localhost:3000/api/hardware_profiles/t1.micro");
+		instance->hwp.id = strdup("t1.micro");
+		instance->hwp.name = strdup("t1.micro");
+		instance->public_addresses = bench_addresses("54.%d", i);
+		instance->private_addresses = bench_addresses("10.%d", i);
+
+		*tail = instance;
+		tail = &instance->next;
+	}
+
+	*instances = head;
+
+	return 0;
+}
+
+void	deltacloud_free_instance_list(struct deltacloud_instance **instances)
+{
+	struct deltacloud_instance	*instance, *next;
+
+	for (instance = *instances; NULL != instance; instance = next)
+	{
+		next = instance->next;
+		free(instance->id);
+		free(instance->href);
+		free(instance->name);
+		free(instance->owner_id);
+		free(instance->image_id);
+		free(instance->image_href);
+		free(instance->realm_id);
+		free(instance->realm_href);
+		free(instance->state);
+		free(instance->launch_time);
+		free(instance->hwp.href);
+		free(instance->hwp.id);
+		free(instance->hwp.name);
+		bench_free_addresses(instance->public_addresses);
+		bench_free_addresses(instance->private_addresses);
+		free(instance);
+	}
+
+	*instances = NULL;
+}
+
+int	deltacloud_get_metrics_by_instance_id(struct deltacloud_api *api, const char *instance_id,
+		struct deltacloud_metric **metrics)
+{
+	struct deltacloud_metric	*head = NULL, **tail = &head, *metric;
+	int				i;
+
+	for (i = 0; i < bench_fleet_metrics; i++)
+	{
+		metric = calloc(1, sizeof(struct deltacloud_metric));
+
+		if (i < BENCH_METRIC_NAMES_NUM)
+			metric->name = strdup(bench_metric_names[i]);
+		else
+			metric->name = bench_strdup_printf("CustomMetric%d", i);
+
+		metric->href = bench_strdup_printf("http://localhost:3000/api/metrics/%d", i);
+		metric->values = calloc(1, sizeof(struct deltacloud_metric_value));
+		metric->values->unit = strdup(0 == i ? "Percent" : "Count");
+		metric->values->minimum = bench_strdup_printf("%d.5", i);
+		metric->values->maximum = bench_strdup_printf("%d.25", i * 10);
+		metric->values->samples = strdup("5.0");
+		metric->values->average = bench_strdup_printf("%d.125", i * 3);
+
+		*tail = metric;
+		tail = &metric->next;
+	}
+
+	*metrics = head;
+
+	return 0;
+}
+
+void	deltacloud_free_metric_list(struct deltacloud_metric **metrics)
+{
+	struct deltacloud_metric	*metric, *next;
+
+	for (metric = *metrics; NULL != metric; metric = next)
+	{
+		next = metric->next;
+		free(metric->name);
+		free(metric->href);
+
+		if (NULL != metric->values)
+		{
+			free(metric->values->unit);
+			free(metric->values->minimum);
+			free(metric->values->maximum);
+			free(metric->values->samples);
+			free(metric->values->average);
+			free(metric->values);
+		}
+
+		free(metric);
+	}
+
+	*metrics = NULL;
+}
@@ -24,126 +24,257 @@
 #include "log.h"
 #include "zbxalgo.h"
 #include "cfg.h"
+#include "md5.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <libdeltacloud/libdeltacloud.h>
 #include <string.h>
+#include <sys/mman.h>
 
 #define ZBX_IPC_CLOUD_ID 'c'
 #define NAME_MACRO "{#INSTANCE.NAME}"
 #define ID_MACRO "{#INSTANCE.ID}"
 #define PUBLIC_ADDR_MACRO "{#INSTANCE.PUBLIC_ADDR}"
 #define PRIVATE_ADDR_MACRO "{#INSTANCE.PRIVATE_ADDR}"
+#define PUBLIC_ADDRS_MACRO "{#INSTANCE.PUBLIC_ADDRS}"
+#define PRIVATE_ADDRS_MACRO "{#INSTANCE.PRIVATE_ADDRS}"
 #define METRIC_NAME_MACRO "{#METRIC.NAME}"
 #define METRIC_UNIT_MACRO "{#METRIC.UNIT}"
-#define CONFIG_FILE "/etc/zabbix/cloud_module.conf"
+#ifndef CONFIG_FILE
+#	define CONFIG_FILE "/etc/zabbix/cloud_module.conf"
+#endif
 #define EXPIRE_TIME 60*60*24
-
+#define RETRY_TIME 60
+#define HOUSEKEEPING_PERIOD 60
+/* CloudWatch stores a datapoint a little after the end of its period */
+#define METRIC_DELAY 30
+/* longest interval between metric refreshes of an instance whose values do not change */
+#define METRIC_QUIET_MAX SEC_PER_HOUR
+/* instances stored in cloud_mem under one lock during an instance refresh */
+#define INSTANCE_PAGE_SIZE 100
+#define SNAPSHOT_PERIOD 300
+#define SNAPSHOT_MAGIC "ZBXCLOUD"
+#define SNAPSHOT_VERSION 2
+/* item keys with hit and miss counters, in the order of keys[] */
+#define CLOUD_STATS_KEYS_NUM 6
+/* upper bounds of the latency and duration histogram buckets, the last bucket has none */
+#define CLOUD_STATS_BUCKETS_NUM 5
+
+/* deprecated, accepted so configuration files of earlier versions still load */
 int CONFIG_MODULE_TIMEOUT	= 300;
 zbx_uint64_t	CONFIG_MODULE_CLOUD_CACHE_SIZE	= 4 * ZBX_MEBIBYTE;
 char *CONFIG_ZABBIX_FILE = NULL;
+int CONFIG_MODULE_INSTANCE_REFRESH	= 600;
+int CONFIG_MODULE_METRIC_REFRESH	= 300;
+int CONFIG_MODULE_METRIC_BATCH_SIZE	= 100;
+int CONFIG_MODULE_CACHE_EXPIRE	= EXPIRE_TIME;
+int CONFIG_MODULE_COLLECTOR_FORKS	= 2;
+int CONFIG_MODULE_ENDPOINT_COLLECTORS	= 2;
+char *CONFIG_MODULE_SNAPSHOT_FILE = NULL;
+int CONFIG_MODULE_TRACE_SIZE	= 4096;
+int CONFIG_MODULE_TRACE_SAMPLING	= 1;
 
 /* the variable keeps timeout setting for item processing */
 static int	item_timeout = 300; 
 
 int	zbx_module_cloud_instance_discovery(AGENT_REQUEST *request, AGENT_RESULT *result);
 int	zbx_module_cloud_instance_info(AGENT_REQUEST *request, AGENT_RESULT *result);
+int	zbx_module_cloud_instance_info_all(AGENT_REQUEST *request, AGENT_RESULT *result);
 int	zbx_module_cloud_metric_discovery(AGENT_REQUEST *request, AGENT_RESULT *result);
 int	zbx_module_cloud_metric(AGENT_REQUEST *request, AGENT_RESULT *result);
+int	zbx_module_cloud_metric_all(AGENT_REQUEST *request, AGENT_RESULT *result);
+int	zbx_module_cloud_module_stats(AGENT_REQUEST *request, AGENT_RESULT *result);
+int	zbx_module_cloud_module_trace(AGENT_REQUEST *request, AGENT_RESULT *result);
 
 static zbx_mem_info_t   *cloud_mem = NULL;
 
+/* process-private pad for the secrets kept in cloud_mem, inherited over fork() */
+#define CLOUD_SECRET_PAD_LEN 256
+static unsigned char	cloud_secret_pad[CLOUD_SECRET_PAD_LEN];
+
+/* the semaphore protecting cloud_mem between pollers and the collector */
+static int	cloud_lock_id = -1;
+
+#define CLOUD_SEM_READERS	0
+#define CLOUD_SEM_WRITER	1
+#define CLOUD_SEM_COUNT		2
+static pid_t	*cloud_collector_pids = NULL;
+
+/* termination signals held back while a collector writes to cloud_mem, empty in the pollers */
+static sigset_t	cloud_collector_sigmask;
+
 ZBX_MEM_FUNC_IMPL(__cloud, cloud_mem);
 
 //////
 
 
+/* module counters in cloud_mem, see zbx_module_cloud_module_stats() */
+typedef struct
+{
+	/* item calls which found or did not find their data in the cache, by index in keys[] */
+	zbx_uint64_t	hits[CLOUD_STATS_KEYS_NUM];
+	zbx_uint64_t	misses[CLOUD_STATS_KEYS_NUM];
+	zbx_uint64_t	api_connects;
+	zbx_uint64_t	api_instance_requests;
+	zbx_uint64_t	api_metric_requests;
+	zbx_uint64_t	api_errors;
+	/* due instance refreshes delayed because ModuleEndpointCollectors collectors work against */
+	/* their endpoint, each delayed refresh is counted once however long it waits             */
+	zbx_uint64_t	api_throttled;
+	zbx_uint64_t	api_latency[CLOUD_STATS_BUCKETS_NUM];
+	zbx_uint64_t	api_latency_ms;
+	zbx_uint64_t	refreshes;
+	zbx_uint64_t	refresh_duration[CLOUD_STATS_BUCKETS_NUM];
+	zbx_uint64_t	refresh_duration_ms;
+}
+zbx_cloud_stats_t;
+
+/* item call recorded in the trace ring, see cloud_item_done() */
+typedef struct
+{
+	zbx_uint32_t	seq;		/* number of the event + 1, 0 while the slot is being written */
+	int		clock;
+	pid_t		pid;
+	zbx_hash_t	hash;		/* of the item parameters without the secret */
+	zbx_uint32_t	duration_us;
+	unsigned char	key;		/* index in keys[] */
+	unsigned char	hit;
+}
+zbx_cloud_trace_event_t;
+
 typedef struct
 {
-	zbx_vector_ptr_t	services;
+	zbx_hashset_t	services;
+	zbx_cloud_stats_t	stats;
+	/* ModuleTraceSize events, written by the pollers without locking */
+	zbx_cloud_trace_event_t	*trace;
+	zbx_uint32_t	trace_next;
+	/* metric unit names, only a handful of them exist so they are stored once */
+	zbx_vector_ptr_t	units;
+	/* refcounted strings shared between instances, see cloud_strpool_intern() */
+	zbx_hashset_t	strpool;
 }
 zbx_deltacloud_t;
 
 typedef struct
 {
+	/* md5 of the connection tuple, the key of deltacloud->services */
+	md5_byte_t	digest[MD5_DIGEST_SIZE];
 	char    *url;
         char    *key;
-        char    *secret;
+        char    *secret;	/* masked, see cloud_secret_mask() */
+        size_t	secret_len;
         char    *driver;
         char    *provider;
         int	lastcheck;
         int	lastaccess;
+        int	nextcheck;
+        int	jitter;		/* spreads the refreshes of different services, taken from the digest */
+        int	refreshing;	/* number of collectors working on the service */
+        int	throttled;	/* the due refresh waits for the endpoint, counted once in api.throttled */
         zbx_vector_ptr_t  instances;
-        zbx_vector_ptr_t  metric_infos;
+        zbx_hashset_t	instances_index;
+        /* zbx_deltacloud_metric_info_t by instance id, the only owner of the metric sets */
+        zbx_hashset_t	metric_infos;
+        char	*lld;		/* rendered cloud.instance.discovery, see cloud_instance_lld_update() */
+        zbx_hash_t	lld_hash;
 }
 zbx_deltacloud_service_t;
 
+#define CLOUD_METRIC_MINIMUM	0x01
+#define CLOUD_METRIC_MAXIMUM	0x02
+#define CLOUD_METRIC_SAMPLES	0x04
+#define CLOUD_METRIC_AVERAGE	0x08
+
 typedef struct
 {
-	char *unit;
-	char *minimum;
-	char *maximum;
-	char *samples;
-	char *average;
+	double minimum;
+	double maximum;
+	double samples;
+	double average;
+	int unit;		/* index in deltacloud->units, -1 if there is no unit */
+	unsigned char flags;	/* CLOUD_METRIC_* of the values which are set */
 }
 zbx_deltacloud_metric_value_t;
 
 typedef struct
 {
-	char *href;
-	char *name;
-	zbx_deltacloud_metric_value_t *metric_value;
+	const char *name;
+	zbx_deltacloud_metric_value_t metric_value;
 }
 zbx_deltacloud_metric_t;
 	
 typedef struct
 {
-	char *href;
-	char *id;
-	char *name;
-	struct deltacloud_property *properties;
+	const char *href;
+	const char *id;
+	const char *name;
 }
 zbx_deltacloud_hardware_profile_t;
 
+/* strings unique to an instance, see cloud_instance_str() */
+#define CLOUD_INSTANCE_HREF		0
+#define CLOUD_INSTANCE_ID		1
+#define CLOUD_INSTANCE_NAME		2
+#define CLOUD_INSTANCE_LAUNCH_TIME	3
+/* the first address of the kind, the other ones follow it, see cloud_instance_addresses_num() */
+#define CLOUD_INSTANCE_PUBLIC_ADDR	4
+#define CLOUD_INSTANCE_PRIVATE_ADDR	5
+#define CLOUD_INSTANCE_STRINGS_NUM	6
+
+/* owner, image, realm, state and hardware profile repeat across instances and are interned, */
+/* the strings unique to the instance follow the record in the same allocation              */
 typedef struct
 {
-	char *href;
-	char *id;
-	char *name;
-	char *owner_id;
-	char *image_id;
-	char *image_href;
-	char *realm_id;
-	char *realm_href;
-	char *state;
-	char *launch_time;
-	zbx_deltacloud_hardware_profile_t *hwp;
-	zbx_vector_ptr_t public_addresses;
-	zbx_vector_ptr_t private_addresses;
+	const char *owner_id;
+	const char *image_id;
+	const char *image_href;
+	const char *realm_id;
+	const char *realm_href;
+	const char *state;
+	zbx_deltacloud_hardware_profile_t hwp;
+	int lastseen;	/* time of the last refresh that returned this instance */
+	/* offsets of the unique strings from the start of the record, 0 if the string is not set */
+	zbx_uint32_t strings[CLOUD_INSTANCE_STRINGS_NUM];
+	/* number of public and private addresses */
+	unsigned short addresses_num[CLOUD_INSTANCE_STRINGS_NUM - CLOUD_INSTANCE_PUBLIC_ADDR];
 }
 zbx_deltacloud_instance_t;
 
+/* metric set of an instance, stored in the metric_infos hashset of its service keyed by instance id */
 typedef struct
 {
 	char *instance_id;
+	int lastcheck;
+	int nextcheck;
+	int lastaccess;
+	unsigned char refreshing;	/* claimed by a collector */
+	unsigned char quiet;		/* refreshes in a row which brought no new values */
 	zbx_vector_ptr_t metrics;
+	zbx_hashset_t metrics_index;
+	char *lld;		/* rendered cloud.metric.discovery, see cloud_metric_lld_update() */
+	zbx_hash_t lld_hash;
 }
 zbx_deltacloud_metric_info_t;
 
-typedef struct 
+/* hash index entry, id points to the string owned by the indexed object */
+typedef struct
 {
-	char *address;
+	const char *id;
+	void *data;
 }
-zbx_deltacloud_address_t;
+zbx_deltacloud_index_t;
 
-static void     cloud_service_shared_free(zbx_deltacloud_service_t *service);
+static void     cloud_service_shared_clean(zbx_deltacloud_service_t *service);
 static void	cloud_instance_shared_free(zbx_deltacloud_instance_t *instance);
 static void	cloud_metric_shared_free(zbx_deltacloud_metric_t *metric);
-static void	cloud_metric_value_shared_free(zbx_deltacloud_metric_value_t *value);
+static void	cloud_metric_info_shared_clean(zbx_deltacloud_metric_info_t *metric_info);
+static void	cloud_collector_run(pid_t parent_pid, int collector_num);
 
 static zbx_deltacloud_t	*deltacloud = NULL; 
 
 #define CLOUD_VECTOR_CREATE(ref, type) zbx_vector_##type##_create_ext(ref, __cloud_mem_malloc_func, __cloud_mem_realloc_func, __cloud_mem_free_func)
+#define CLOUD_INDEX_CREATE(ref) zbx_hashset_create_ext(ref, 0, cloud_index_hash_func, cloud_index_compare_func, __cloud_mem_malloc_func, __cloud_mem_realloc_func, __cloud_mem_free_func)
 
 ///////
 
@@ -152,11 +283,133 @@ static ZBX_METRIC keys[] =
 {
 	{"cloud.instance.discovery",	CF_HAVEPARAMS,	zbx_module_cloud_instance_discovery,"http://hostname/api,ABC1223DE,ZDADQWQ2133,ec2,ap-northeast-1"},
 	{"cloud.instance.info",	CF_HAVEPARAMS,	zbx_module_cloud_instance_info,"http://hostname/api,ABC1223DE,ZDADQWQ2133,ec2,ap-northeast-1,instance_id,element"},
+	{"cloud.instance.info.all",	CF_HAVEPARAMS,	zbx_module_cloud_instance_info_all,"http://hostname/api,ABC1223DE,ZDADQWQ2133,ec2,ap-northeast-1"},
 	{"cloud.metric.discovery",	CF_HAVEPARAMS,	zbx_module_cloud_metric_discovery,"http://hostname/api,ABC1223DE,ZDADQWQ2133,ec2,ap-northeast-1,instance_id"},
 	{"cloud.metric",	CF_HAVEPARAMS,	zbx_module_cloud_metric,"http://hostname/api,ABC1223DE,ZDADQWQ2133,ec2,ap-northeast-1,instance_id,DiskReadOps,average"},
+	{"cloud.metric.all",	CF_HAVEPARAMS,	zbx_module_cloud_metric_all,"http://hostname/api,ABC1223DE,ZDADQWQ2133,ec2,ap-northeast-1,instance_id"},
+	{"cloud.module.stats",	CF_HAVEPARAMS,	zbx_module_cloud_module_stats,"api.errors"},
+	{"cloud.module.trace",	CF_HAVEPARAMS,	zbx_module_cloud_module_trace,"100"},
 	{NULL}
 };
 
+/* indexes of the item keys in keys[] and zbx_cloud_stats_t */
+#define CLOUD_STATS_INSTANCE_DISCOVERY	0
+#define CLOUD_STATS_INSTANCE_INFO	1
+#define CLOUD_STATS_INSTANCE_INFO_ALL	2
+#define CLOUD_STATS_METRIC_DISCOVERY	3
+#define CLOUD_STATS_METRIC		4
+#define CLOUD_STATS_METRIC_ALL		5
+
+/* pollers update the counters while sharing the read lock, so the updates are atomic */
+#define CLOUD_STATS_ADD(counter, value)	__sync_fetch_and_add(&(counter), (zbx_uint64_t)(value))
+
+static const double	cloud_stats_latency_bounds[CLOUD_STATS_BUCKETS_NUM - 1] = {0.01, 0.1, 1, 10};
+static const char	*cloud_stats_latency_names[CLOUD_STATS_BUCKETS_NUM] =
+		{"le_10ms", "le_100ms", "le_1s", "le_10s", "gt_10s"};
+static const double	cloud_stats_duration_bounds[CLOUD_STATS_BUCKETS_NUM - 1] = {1, 10, 60, 300};
+static const char	*cloud_stats_duration_names[CLOUD_STATS_BUCKETS_NUM] =
+		{"le_1s", "le_10s", "le_60s", "le_300s", "gt_300s"};
+
+/* counts a value in its histogram bucket and adds it to the sum in milliseconds */
+static void	cloud_stats_observe(zbx_uint64_t *buckets, zbx_uint64_t *sum_ms, const double *bounds, double value)
+{
+	int	i;
+
+	for (i = 0; i < CLOUD_STATS_BUCKETS_NUM - 1 && value > bounds[i]; i++)
+		;
+
+	CLOUD_STATS_ADD(buckets[i], 1);
+	CLOUD_STATS_ADD(*sum_ms, value * 1000);
+}
+
+static void	cloud_stats_api_latency(double start)
+{
+	cloud_stats_observe(deltacloud->stats.api_latency, &deltacloud->stats.api_latency_ms,
+			cloud_stats_latency_bounds, zbx_time() - start);
+}
+
+/* the item call being traced by this poller, 0 if it is not sampled */
+static double		cloud_trace_start = 0;
+static zbx_hash_t	cloud_trace_hash;
+static zbx_uint64_t	cloud_trace_calls = 0;
+
+/******************************************************************************
+ *                                                                            *
+ * Function: cloud_trace_begin                                                *
+ *                                                                            *
+ * Purpose: start timing an item call if it is one of the ModuleTraceSampling *
+ *          calls of this poller which are traced                            *
+ *                                                                            *
+ ******************************************************************************/
+static void	cloud_trace_begin(const AGENT_REQUEST *request)
+{
+	int		i;
+	const char	*param;
+
+	cloud_trace_start = 0;
+
+	if (NULL == deltacloud->trace || 0 != cloud_trace_calls++ % CONFIG_MODULE_TRACE_SAMPLING)
+		return;
+
+	cloud_trace_hash = ZBX_DEFAULT_HASH_SEED;
+
+	/* the third parameter is the secret key, it is not hashed into the trace */
+	for (i = 0; i < request->nparam; i++)
+	{
+		if (2 == i)
+			continue;
+
+		param = get_rparam(request, i);
+		cloud_trace_hash = ZBX_DEFAULT_STRING_HASH_ALGO(param, strlen(param), cloud_trace_hash);
+	}
+
+	cloud_trace_start = zbx_time();
+}
+
+/******************************************************************************
+ *                                                                            *
+ * Function: cloud_item_done                                                  *
+ *                                                                            *
+ * Purpose: count an item call which found (SUCCEED) or did not find (FAIL)   *
+ *          its data in the cache, and record it in the trace ring if traced  *
+ *                                                                            *
+ * Comment: each poller claims a slot with an atomic increment, the sequence  *
+ *          number is written last so cloud.module.trace skips slots which    *
+ *          are being written or were overwritten while it read them          *
+ *                                                                            *
+ ******************************************************************************/
+static void	cloud_item_done(int key, int found)
+{
+	zbx_uint32_t		num;
+	zbx_cloud_trace_event_t	*event;
+
+	if (SUCCEED == found)
+		CLOUD_STATS_ADD(deltacloud->stats.hits[key], 1);
+	else
+		CLOUD_STATS_ADD(deltacloud->stats.misses[key], 1);
+
+	if (0 == cloud_trace_start)
+		return;
+
+	num = __sync_fetch_and_add(&deltacloud->trace_next, 1);
+	event = &deltacloud->trace[num & (CONFIG_MODULE_TRACE_SIZE - 1)];
+
+	event->seq = 0;
+	__sync_synchronize();
+
+	event->clock = time(NULL);
+	event->pid = getpid();
+	event->hash = cloud_trace_hash;
+	event->duration_us = (zbx_uint32_t)((zbx_time() - cloud_trace_start) * 1000000);
+	event->key = (unsigned char)key;
+	event->hit = (SUCCEED == found);
+
+	__sync_synchronize();
+	event->seq = num + 1;
+
+	cloud_trace_start = 0;
+}
+
 /******************************************************************************
  *                                                                            *
  * Function: zbx_module_api_version                                           *
@@ -201,6 +454,115 @@ ZBX_METRIC	*zbx_module_item_list()
 }
 
 
+static zbx_hash_t	cloud_index_hash_func(const void *data)
+{
+	const zbx_deltacloud_index_t	*entry = (const zbx_deltacloud_index_t *)data;
+
+	return ZBX_DEFAULT_STRING_HASH_ALGO(entry->id, strlen(entry->id), ZBX_DEFAULT_HASH_SEED);
+}
+
+static int	cloud_index_compare_func(const void *d1, const void *d2)
+{
+	const zbx_deltacloud_index_t	*e1 = (const zbx_deltacloud_index_t *)d1;
+	const zbx_deltacloud_index_t	*e2 = (const zbx_deltacloud_index_t *)d2;
+
+	return strcmp(e1->id, e2->id);
+}
+
+static void	cloud_index_add(zbx_hashset_t *index, const char *id, void *data)
+{
+	zbx_deltacloud_index_t	entry;
+
+	if (NULL == id)
+		return;
+
+	entry.id = id;
+	entry.data = data;
+
+	zbx_hashset_insert(index, &entry, sizeof(entry));
+}
+
+static void	*cloud_index_get(zbx_hashset_t *index, const char *id)
+{
+	zbx_deltacloud_index_t	entry, *found;
+
+	if (NULL == id)
+		return NULL;
+
+	entry.id = id;
+
+	if (NULL == (found = zbx_hashset_search(index, &entry)))
+		return NULL;
+
+	return found->data;
+}
+
+static void	cloud_index_remove(zbx_hashset_t *index, const char *id)
+{
+	zbx_deltacloud_index_t	entry;
+
+	entry.id = id;
+	zbx_hashset_remove(index, &entry);
+}
+
+#define	REFCOUNT_FIELD_SIZE	sizeof(zbx_uint32_t)
+
+static zbx_hash_t	cloud_strpool_hash_func(const void *data)
+{
+	return ZBX_DEFAULT_STRING_HASH_FUNC((const char *)data + REFCOUNT_FIELD_SIZE);
+}
+
+static int	cloud_strpool_compare_func(const void *d1, const void *d2)
+{
+	return strcmp((const char *)d1 + REFCOUNT_FIELD_SIZE, (const char *)d2 + REFCOUNT_FIELD_SIZE);
+}
+
+/******************************************************************************
+ *                                                                            *
+ * Function: cloud_strpool_intern                                             *
+ *                                                                            *
+ * Purpose: return the pooled copy of a string, adding it to the pool or      *
+ *          increasing its reference count                                    *
+ *                                                                            *
+ * Comment: the reference count is stored right before the string, the same  *
+ *          way as in the configuration cache string pool                     *
+ *                                                                            *
+ ******************************************************************************/
+static const char	*cloud_strpool_intern(const char *str)
+{
+	void		*record;
+	zbx_uint32_t	*refcount;
+
+	if (NULL == str)
+		return NULL;
+
+	record = zbx_hashset_search(&deltacloud->strpool, str - REFCOUNT_FIELD_SIZE);
+
+	if (NULL == record)
+	{
+		record = zbx_hashset_insert_ext(&deltacloud->strpool, str - REFCOUNT_FIELD_SIZE,
+				REFCOUNT_FIELD_SIZE + strlen(str) + 1, REFCOUNT_FIELD_SIZE);
+		*(zbx_uint32_t *)record = 0;
+	}
+
+	refcount = (zbx_uint32_t *)record;
+	(*refcount)++;
+
+	return (const char *)record + REFCOUNT_FIELD_SIZE;
+}
+
+static void	cloud_strpool_release(const char *str)
+{
+	zbx_uint32_t	*refcount;
+
+	if (NULL == str)
+		return;
+
+	refcount = (zbx_uint32_t *)(str - REFCOUNT_FIELD_SIZE);
+	if (0 == --(*refcount))
+		zbx_hashset_remove(&deltacloud->strpool, str - REFCOUNT_FIELD_SIZE);
+}
+
 static char	*cloud_shared_strdup(const char *source)
 {
 	char	*ptr = NULL;
@@ -216,22 +578,210 @@ static char	*cloud_shared_strdup(const char *source)
 	return ptr;
 }
 
-static zbx_deltacloud_hardware_profile_t *cloud_hardware_profile_shared_dup(const struct deltacloud_hardware_profile *src)
-{
-	zbx_deltacloud_hardware_profile_t	*hardware_profile;
-	hardware_profile = __cloud_mem_malloc_func(NULL, sizeof(zbx_deltacloud_hardware_profile_t));
 	
-	hardware_profile->href = cloud_shared_strdup(src->href);
-	hardware_profile->id = cloud_shared_strdup(src->id);
-	hardware_profile->name = cloud_shared_strdup(src->name);
-	return hardware_profile;
+
+static void	cloud_semop(struct sembuf *ops, size_t nops)
+{
+	while (-1 == semop(cloud_lock_id, ops, nops))
+	{
+		if (EINTR != errno)
+		{
+			zabbix_log(LOG_LEVEL_CRIT, "cannot operate on cloud cache lock: %s", zbx_strerror(errno));
+			exit(FAIL);
+		}
+	}
 }
-	
 
-static zbx_deltacloud_service_t	*zbx_deltacloud_get_service(const char* url, const char* key, const char* secret, const char* driver, const char* provider)
+/******************************************************************************
+ *                                                                            *
+ * Function: cloud_rdlock                                                     *
+ *                                                                            *
+ * Purpose: lock cloud_mem for reading, shared with the other pollers         *
+ *                                                                            *
+ * Comment: the lock is a pair of semaphores starting at zero, the number of  *
+ *          readers and the writer flag. Readers wait for no writer and       *
+ *          register in one semop(), a writer raises its flag first so new    *
+ *          readers queue behind it, then waits for the readers to leave.     *
+ *          SEM_UNDO releases the lock if the holder is killed.               *
+ *                                                                            *
+ *          Publishing snapshots instead would need the readers to be tracked *
+ *          before old data could go back to cloud_mem, and the readers only  *
+ *          hold the lock while copying a value or building the JSON anyway.  *
+ *                                                                            *
+ ******************************************************************************/
+static void	cloud_rdlock(void)
 {
-	int i;
-	zbx_deltacloud_service_t	*service = NULL;
+	struct sembuf	ops[2] = {{CLOUD_SEM_WRITER, 0, 0}, {CLOUD_SEM_READERS, 1, SEM_UNDO}};
+
+	cloud_semop(ops, 2);
+}
+
+static void	cloud_rdunlock(void)
+{
+	struct sembuf	ops[1] = {{CLOUD_SEM_READERS, -1, SEM_UNDO}};
+
+	cloud_semop(ops, 1);
+}
+
+/******************************************************************************
+ *                                                                            *
+ * Function: cloud_wrlock                                                     *
+ *                                                                            *
+ * Purpose: lock cloud_mem exclusively, for anything that allocates or frees  *
+ *                                                                            *
+ * Comment: SEM_UNDO would hand half updated data to the others if a          *
+ *          collector was terminated here, so zbx_module_uninit() stops the   *
+ *          collectors between writes. The signals are not blocked for the    *
+ *          whole job, a Deltacloud request may take minutes.                 *
+ *                                                                            *
+ ******************************************************************************/
+static void	cloud_wrlock(void)
+{
+	struct sembuf	ops[2] = {{CLOUD_SEM_WRITER, 0, 0}, {CLOUD_SEM_WRITER, 1, SEM_UNDO}};
+	struct sembuf	wait_readers[1] = {{CLOUD_SEM_READERS, 0, 0}};
+
+	sigprocmask(SIG_BLOCK, &cloud_collector_sigmask, NULL);
+
+	cloud_semop(ops, 2);
+	cloud_semop(wait_readers, 1);
+}
+
+static void	cloud_wrunlock(void)
+{
+	struct sembuf	ops[1] = {{CLOUD_SEM_WRITER, -1, SEM_UNDO}};
+
+	cloud_semop(ops, 1);
+
+	/* a pending SIGTERM terminates the collector here, with the lock released and the data whole */
+	sigprocmask(SIG_UNBLOCK, &cloud_collector_sigmask, NULL);
+}
+
+static zbx_hash_t	cloud_service_hash_func(const void *data)
+{
+	const zbx_deltacloud_service_t	*service = (const zbx_deltacloud_service_t *)data;
+
+	return ZBX_DEFAULT_HASH_ALGO(service->digest, MD5_DIGEST_SIZE, ZBX_DEFAULT_HASH_SEED);
+}
+
+static int	cloud_service_compare_func(const void *d1, const void *d2)
+{
+	const zbx_deltacloud_service_t	*s1 = (const zbx_deltacloud_service_t *)d1;
+	const zbx_deltacloud_service_t	*s2 = (const zbx_deltacloud_service_t *)d2;
+
+	return memcmp(s1->digest, s2->digest, MD5_DIGEST_SIZE);
+}
+
+static zbx_hash_t	cloud_metric_info_hash_func(const void *data)
+{
+	const zbx_deltacloud_metric_info_t	*metric_info = (const zbx_deltacloud_metric_info_t *)data;
+
+	return ZBX_DEFAULT_STRING_HASH_ALGO(metric_info->instance_id, strlen(metric_info->instance_id),
+			ZBX_DEFAULT_HASH_SEED);
+}
+
+static int	cloud_metric_info_compare_func(const void *d1, const void *d2)
+{
+	const zbx_deltacloud_metric_info_t	*m1 = (const zbx_deltacloud_metric_info_t *)d1;
+	const zbx_deltacloud_metric_info_t	*m2 = (const zbx_deltacloud_metric_info_t *)d2;
+
+	return strcmp(m1->instance_id, m2->instance_id);
+}
+
+/******************************************************************************
+ *                                                                            *
+ * Function: cloud_service_digest                                             *
+ *                                                                            *
+ * Purpose: calculate the registry key of a service from its connection       *
+ *          parameters, each one is hashed with its terminating zero so the   *
+ *          field boundaries are part of the digest                           *
+ *                                                                            *
+ ******************************************************************************/
+static void	cloud_service_digest(const char *url, const char *key, const char *secret, const char *driver,
+		const char *provider, md5_byte_t *digest)
+{
+	md5_state_t	state;
+
+	zbx_md5_init(&state);
+	zbx_md5_append(&state, (const md5_byte_t *)url, strlen(url) + 1);
+	zbx_md5_append(&state, (const md5_byte_t *)key, strlen(key) + 1);
+	zbx_md5_append(&state, (const md5_byte_t *)secret, strlen(secret) + 1);
+	zbx_md5_append(&state, (const md5_byte_t *)driver, strlen(driver) + 1);
+	zbx_md5_append(&state, (const md5_byte_t *)provider, strlen(provider) + 1);
+	zbx_md5_finish(&state, digest);
+}
+
+static void	cloud_secret_pad_init(void)
+{
+	int	fd, i;
+
+	if (-1 != (fd = open("/dev/urandom", O_RDONLY)))
+	{
+		if (sizeof(cloud_secret_pad) == read(fd, cloud_secret_pad, sizeof(cloud_secret_pad)))
+		{
+			close(fd);
+			return;
+		}
+		close(fd);
+	}
+
+	for (i = 0; i < CLOUD_SECRET_PAD_LEN; i++)
+		cloud_secret_pad[i] = (unsigned char)rand();
+}
+
+/******************************************************************************
+ *                                                                            *
+ * Function: cloud_secret_mask                                                *
+ *                                                                            *
+ * Purpose: copy a secret into cloud_mem masked with the process-private pad  *
+ *                                                                            *
+ * Comment: the collector needs the secret to talk to Deltacloud, so it has   *
+ *          to be shared, but the raw value never appears in shared memory    *
+ *          (shm dumps, ipcs tooling). The pad itself lives only in the       *
+ *          memory of the Zabbix processes.                                   *
+ *                                                                            *
+ ******************************************************************************/
+static char	*cloud_secret_mask(const char *secret, size_t *len)
+{
+	char	*masked;
+	size_t	i;
+
+	*len = strlen(secret);
+	masked = __cloud_mem_malloc_func(NULL, *len + 1);
+
+	for (i = 0; i < *len; i++)
+		masked[i] = secret[i] ^ cloud_secret_pad[i % CLOUD_SECRET_PAD_LEN];
+
+	return masked;
+}
+
+static char	*cloud_secret_unmask(const char *masked, size_t len)
+{
+	char	*secret;
+	size_t	i;
+
+	secret = zbx_malloc(NULL, len + 1);
+
+	for (i = 0; i < len; i++)
+		secret[i] = masked[i] ^ cloud_secret_pad[i % CLOUD_SECRET_PAD_LEN];
+	secret[len] = '\0';
+
+	return secret;
+}
+
+/******************************************************************************
+ *                                                                            *
+ * Function: cloud_service_find                                               *
+ *                                                                            *
+ * Purpose: find a registered service, the caller holds either lock           *
+ *                                                                            *
+ * Comment: lastaccess is only a hint for housekeeping, concurrent readers    *
+ *          storing the same int is harmless                                  *
+ *                                                                            *
+ ******************************************************************************/
+static zbx_deltacloud_service_t	*cloud_service_find(const char *url, const char *key, const char *secret,
+		const char *driver, const char *provider)
+{
+	zbx_deltacloud_service_t	service_local, *service;
 
 	if (NULL == deltacloud)
 	{
@@ -239,489 +789,2719 @@ static zbx_deltacloud_service_t	*zbx_deltacloud_get_service(const char* url, con
 		return NULL;
 	}
 
-	for (i = 0; i < deltacloud->services.values_num; i++)
+	memset(&service_local, 0, sizeof(service_local));
+	cloud_service_digest(url, key, secret, driver, provider, service_local.digest);
+
+	if (NULL != (service = zbx_hashset_search(&deltacloud->services, &service_local)))
+		service->lastaccess = time(NULL);
+
+	return service;
+}
+
+/******************************************************************************
+ *                                                                            *
+ * Function: cloud_service_create                                             *
+ *                                                                            *
+ * Purpose: add a service without its secret to the cloud cache               *
+ *                                                                            *
+ ******************************************************************************/
+static zbx_deltacloud_service_t	*cloud_service_create(const md5_byte_t *digest, const char *url, const char *key,
+		const char *driver, const char *provider)
+{
+	zbx_deltacloud_service_t	service_local, *service;
+
+	memset(&service_local, 0, sizeof(service_local));
+	memcpy(service_local.digest, digest, MD5_DIGEST_SIZE);
+
+	service = zbx_hashset_insert(&deltacloud->services, &service_local, sizeof(zbx_deltacloud_service_t));
+
+	service->url = cloud_shared_strdup(url);
+	service->key = cloud_shared_strdup(key);
+	service->driver = cloud_shared_strdup(driver);
+	service->provider = cloud_shared_strdup(provider);
+	service->lastaccess = time(NULL);
+	/* lastcheck stays 0 until the collector has fetched the instances */
+	service->nextcheck = 0;
+	service->jitter = (service->digest[0] << 8) | service->digest[1];
+	CLOUD_VECTOR_CREATE(&service->instances, ptr);
+	CLOUD_INDEX_CREATE(&service->instances_index);
+	zbx_hashset_create_ext(&service->metric_infos, 0, cloud_metric_info_hash_func, cloud_metric_info_compare_func,
+			__cloud_mem_malloc_func, __cloud_mem_realloc_func, __cloud_mem_free_func);
+
+	return service;
+}
+
+/******************************************************************************
+ *                                                                            *
+ * Function: zbx_deltacloud_get_service                                       *
+ *                                                                            *
+ * Purpose: find or register a service, the caller holds the write lock       *
+ *                                                                            *
+ ******************************************************************************/
+static zbx_deltacloud_service_t	*zbx_deltacloud_get_service(const char* url, const char* key, const char* secret, const char* driver, const char* provider)
+{
+	zbx_deltacloud_service_t	*service = NULL;
+	md5_byte_t			digest[MD5_DIGEST_SIZE];
+
+	if (NULL == deltacloud)
+		return NULL;
+
+	if (NULL != (service = cloud_service_find(url, key, secret, driver, provider)))
+	{
+		/* a service restored from the snapshot gets its secret from the first item using it */
+		if (NULL == service->secret)
+			service->secret = cloud_secret_mask(secret, &service->secret_len);
+
+		return service;
+	}
+
+	cloud_service_digest(url, key, secret, driver, provider, digest);
+
+	service = cloud_service_create(digest, url, key, driver, provider);
+	service->secret = cloud_secret_mask(secret, &service->secret_len);
+
+	return service;
+}
+
+/******************************************************************************
+ *                                                                            *
+ * Function: cloud_service_register                                           *
+ *                                                                            *
+ * Purpose: register a service seen by a reader, so the collector picks it up *
+ *                                                                            *
+ ******************************************************************************/
+static void	cloud_service_register(const char *url, const char *key, const char *secret, const char *driver,
+		const char *provider)
+{
+	cloud_wrlock();
+	zbx_deltacloud_get_service(url, key, secret, driver, provider);
+	cloud_wrunlock();
+}
+
+/******************************************************************************
+ *                                                                            *
+ * Function: cloud_service_acquire                                            *
+ *                                                                            *
+ * Purpose: find the service of a reader and return with the read lock held   *
+ *                                                                            *
+ * Return value: the service, NULL if the cloud cache is not initialized      *
+ *                                                                            *
+ * Comment: an unknown service is registered, and a service restored from the *
+ *          snapshot gets its secret, under the write lock first. Restored    *
+ *          data is served right away, the collector refreshes it as soon as  *
+ *          the secret is known.                                              *
+ *                                                                            *
+ ******************************************************************************/
+static zbx_deltacloud_service_t	*cloud_service_acquire(const char *url, const char *key, const char *secret,
+		const char *driver, const char *provider)
+{
+	zbx_deltacloud_service_t	*service;
+
+	cloud_rdlock();
+
+	if (NULL == deltacloud)
+		return NULL;
+
+	if (NULL != (service = cloud_service_find(url, key, secret, driver, provider)) && NULL != service->secret)
+		return service;
+
+	cloud_rdunlock();
+
+	cloud_service_register(url, key, secret, driver, provider);
+
+	cloud_rdlock();
+
+	return cloud_service_find(url, key, secret, driver, provider);
+}
+
+static void	cloud_strpool_set(const char **dst, const char *src)
+{
+	if (NULL != *dst && NULL != src && 0 == strcmp(*dst, src))
+		return;
+
+	cloud_strpool_release(*dst);
+	*dst = cloud_strpool_intern(src);
+}
+
+static const char	*cloud_instance_str(const zbx_deltacloud_instance_t *instance, int field)
+{
+	if (0 == instance->strings[field])
+		return NULL;
+
+	return (const char *)instance + instance->strings[field];
+}
+
+static int	cloud_instance_addresses_num(const zbx_deltacloud_instance_t *instance, int field)
+{
+	return instance->addresses_num[field - CLOUD_INSTANCE_PUBLIC_ADDR];
+}
+
+/* the strings of an API instance which are stored in the instance record, except the addresses */
+static void	cloud_instance_strings(const struct deltacloud_instance *instance, const char **strings)
+{
+	strings[CLOUD_INSTANCE_HREF] = instance->href;
+	strings[CLOUD_INSTANCE_ID] = instance->id;
+	strings[CLOUD_INSTANCE_NAME] = instance->name;
+	strings[CLOUD_INSTANCE_LAUNCH_TIME] = instance->launch_time;
+}
+
+static const struct deltacloud_address	*cloud_instance_api_addresses(const struct deltacloud_instance *instance,
+		int field)
+{
+	return CLOUD_INSTANCE_PUBLIC_ADDR == field ? instance->public_addresses : instance->private_addresses;
+}
+
+/******************************************************************************
+ *                                                                            *
+ * Function: cloud_instance_addresses                                         *
+ *                                                                            *
+ * Purpose: return the public or private addresses of an instance as a comma  *
+ *          separated list                                                    *
+ *                                                                            *
+ * Return value: allocated string, empty if the instance has no address of    *
+ *               the kind                                                     *
+ *                                                                            *
+ ******************************************************************************/
+static char	*cloud_instance_addresses(const zbx_deltacloud_instance_t *instance, int field)
+{
+	const char	*address = cloud_instance_str(instance, field);
+	char		*list = NULL;
+	size_t		list_alloc = 0, list_offset = 0;
+	int		i;
+
+	zbx_strcpy_alloc(&list, &list_alloc, &list_offset, "");
+
+	for (i = 0; i < cloud_instance_addresses_num(instance, field); i++, address += strlen(address) + 1)
+	{
+		if (0 != i)
+			zbx_chrcpy_alloc(&list, &list_alloc, &list_offset, ',');
+		zbx_strcpy_alloc(&list, &list_alloc, &list_offset, address);
+	}
+
+	return list;
+}
+
+/* size of the single allocation holding an instance record and its strings */
+static size_t	cloud_instance_size(const zbx_deltacloud_instance_t *instance)
+{
+	const char	*str;
+	size_t		size = sizeof(zbx_deltacloud_instance_t);
+	int		field, i;
+
+	for (field = 0; field < CLOUD_INSTANCE_PUBLIC_ADDR; field++)
+	{
+		if (NULL != (str = cloud_instance_str(instance, field)))
+			size += strlen(str) + 1;
+	}
+
+	for (; field < CLOUD_INSTANCE_STRINGS_NUM; field++)
+	{
+		str = cloud_instance_str(instance, field);
+
+		for (i = 0; i < cloud_instance_addresses_num(instance, field); i++, str += strlen(str) + 1)
+			size += strlen(str) + 1;
+	}
+
+	return size;
+}
+
+static void	cloud_instance_shared_update_pooled(zbx_deltacloud_instance_t *deltacloud_instance,
+		const struct deltacloud_instance *instance)
+{
+	cloud_strpool_set(&deltacloud_instance->owner_id, instance->owner_id);
+	cloud_strpool_set(&deltacloud_instance->image_id, instance->image_id);
+	cloud_strpool_set(&deltacloud_instance->image_href, instance->image_href);
+	cloud_strpool_set(&deltacloud_instance->realm_id, instance->realm_id);
+	cloud_strpool_set(&deltacloud_instance->realm_href, instance->realm_href);
+	cloud_strpool_set(&deltacloud_instance->state, instance->state);
+	cloud_strpool_set(&deltacloud_instance->hwp.href, instance->hwp.href);
+	cloud_strpool_set(&deltacloud_instance->hwp.id, instance->hwp.id);
+	cloud_strpool_set(&deltacloud_instance->hwp.name, instance->hwp.name);
+}
+
+/******************************************************************************
+ *                                                                            *
+ * Function: cloud_instance_shared_update                                     *
+ *                                                                            *
+ * Purpose: bring a cached instance in line with the one returned by the API  *
+ *                                                                            *
+ * Return value: SUCCEED - the instance was updated in place                  *
+ *               FAIL - a string unique to the instance changed, the record   *
+ *                      has to be rebuilt with cloud_instance_shared_dup()    *
+ *                                                                            *
+ * Comment: unchanged fields are left alone, so refreshing a steady account   *
+ *          does not allocate anything in the cloud cache                     *
+ *                                                                            *
+ ******************************************************************************/
+static int	cloud_instance_shared_update(zbx_deltacloud_instance_t *deltacloud_instance,
+		const struct deltacloud_instance *instance)
+{
+	const char	*strings[CLOUD_INSTANCE_STRINGS_NUM], *str;
+	const struct deltacloud_address	*address;
+	int		i, num;
+
+	cloud_instance_strings(instance, strings);
+
+	for (i = 0; i < CLOUD_INSTANCE_PUBLIC_ADDR; i++)
+	{
+		str = cloud_instance_str(deltacloud_instance, i);
+
+		if (NULL == str || NULL == strings[i] ? str != strings[i] : 0 != strcmp(str, strings[i]))
+			return FAIL;
+	}
+
+	for (; i < CLOUD_INSTANCE_STRINGS_NUM; i++)
+	{
+		str = cloud_instance_str(deltacloud_instance, i);
+		num = 0;
+
+		for (address = cloud_instance_api_addresses(instance, i); NULL != address; address = address->next)
+		{
+			if (NULL == address->address)
+				continue;
+
+			if (num == cloud_instance_addresses_num(deltacloud_instance, i) || 0 != strcmp(str, address->address))
+				return FAIL;
+
+			str += strlen(str) + 1;
+			num++;
+		}
+
+		if (num != cloud_instance_addresses_num(deltacloud_instance, i))
+			return FAIL;
+	}
+
+	cloud_instance_shared_update_pooled(deltacloud_instance, instance);
+
+	return SUCCEED;
+}
+
+/******************************************************************************
+ *                                                                            *
+ * Function: cloud_instance_shared_dup                                        *
+ *                                                                            *
+ * Purpose: copy an instance returned by the API into the cloud cache         *
+ *                                                                            *
+ * Comment: the record and its own strings are one allocation, so it is      *
+ *          freed with one call and scanned without chasing pointers. All     *
+ *          the addresses of a kind are stored one after another.             *
+ *                                                                            *
+ ******************************************************************************/
+static zbx_deltacloud_instance_t	*cloud_instance_shared_dup(const struct deltacloud_instance *instance)
+{
+	zbx_deltacloud_instance_t	*deltacloud_instance;
+	const char	*strings[CLOUD_INSTANCE_STRINGS_NUM];
+	const struct deltacloud_address	*address;
+	size_t		len, size = sizeof(zbx_deltacloud_instance_t);
+	int		i;
+
+	cloud_instance_strings(instance, strings);
+
+	for (i = 0; i < CLOUD_INSTANCE_PUBLIC_ADDR; i++)
+	{
+		if (NULL != strings[i])
+			size += strlen(strings[i]) + 1;
+	}
+
+	for (; i < CLOUD_INSTANCE_STRINGS_NUM; i++)
+	{
+		for (address = cloud_instance_api_addresses(instance, i); NULL != address; address = address->next)
+		{
+			if (NULL != address->address)
+				size += strlen(address->address) + 1;
+		}
+	}
+
+	deltacloud_instance = __cloud_mem_malloc_func(NULL, size);
+	memset(deltacloud_instance, 0, sizeof(zbx_deltacloud_instance_t));
+
+	size = sizeof(zbx_deltacloud_instance_t);
+
+	for (i = 0; i < CLOUD_INSTANCE_PUBLIC_ADDR; i++)
+	{
+		if (NULL == strings[i])
+			continue;
+
+		len = strlen(strings[i]) + 1;
+		memcpy((char *)deltacloud_instance + size, strings[i], len);
+		deltacloud_instance->strings[i] = size;
+		size += len;
+	}
+
+	for (; i < CLOUD_INSTANCE_STRINGS_NUM; i++)
+	{
+		for (address = cloud_instance_api_addresses(instance, i); NULL != address; address = address->next)
+		{
+			if (NULL == address->address)
+				continue;
+
+			if (0 == deltacloud_instance->addresses_num[i - CLOUD_INSTANCE_PUBLIC_ADDR]++)
+				deltacloud_instance->strings[i] = size;
+
+			len = strlen(address->address) + 1;
+			memcpy((char *)deltacloud_instance + size, address->address, len);
+			size += len;
+		}
+	}
+
+	cloud_instance_shared_update_pooled(deltacloud_instance, instance);
+
+	return deltacloud_instance;
+}
+
+static int	cloud_unit_get_id(const char *unit)
+{
+	int	i;
+
+	if (NULL == unit || '\0' == *unit)
+		return -1;
+
+	for (i = 0; i < deltacloud->units.values_num; i++)
+	{
+		if (0 == strcmp(deltacloud->units.values[i], unit))
+			return i;
+	}
+
+	zbx_vector_ptr_append(&deltacloud->units, cloud_shared_strdup(unit));
+
+	return i;
+}
+
+static void	cloud_metric_value_set(double *value, unsigned char *flags, unsigned char flag, const char *str)
+{
+	char	*end;
+
+	if (NULL == str || '\0' == *str)
+		return;
+
+	/* Deltacloud formats the values with Ruby, which may use exponents ("1.0e-05") */
+	*value = strtod(str, &end);
+
+	if ('\0' == *end)
+		*flags |= flag;
+}
+
+static void	cloud_metric_value_parse(zbx_deltacloud_metric_value_t *value, const struct deltacloud_metric *metric)
+{
+	memset(value, 0, sizeof(zbx_deltacloud_metric_value_t));
+	value->unit = -1;
+
+	if (metric->values)
+	{
+		value->unit = cloud_unit_get_id(metric->values->unit);
+		cloud_metric_value_set(&value->minimum, &value->flags, CLOUD_METRIC_MINIMUM, metric->values->minimum);
+		cloud_metric_value_set(&value->maximum, &value->flags, CLOUD_METRIC_MAXIMUM, metric->values->maximum);
+		cloud_metric_value_set(&value->samples, &value->flags, CLOUD_METRIC_SAMPLES, metric->values->samples);
+		cloud_metric_value_set(&value->average, &value->flags, CLOUD_METRIC_AVERAGE, metric->values->average);
+	}
+}
+
+static int	cloud_metric_value_compare(const zbx_deltacloud_metric_value_t *v1, const zbx_deltacloud_metric_value_t *v2)
+{
+	if (v1->flags != v2->flags || v1->unit != v2->unit)
+		return FAIL;
+
+	if (v1->minimum != v2->minimum || v1->maximum != v2->maximum || v1->samples != v2->samples ||
+			v1->average != v2->average)
+	{
+		return FAIL;
+	}
+
+	return SUCCEED;
+}
+
+static zbx_deltacloud_metric_t	*cloud_metric_shared_dup(const struct deltacloud_metric *metric)
+{
+	zbx_deltacloud_metric_t	*deltacloud_metric;
+
+	deltacloud_metric = __cloud_mem_malloc_func(NULL, sizeof(zbx_deltacloud_metric_t));
+
+	/* the same metric names are reported for every instance */
+	deltacloud_metric->name = cloud_strpool_intern(metric->name);
+
+	cloud_metric_value_parse(&deltacloud_metric->metric_value, metric);
+
+	return deltacloud_metric;
+}
+
+static zbx_deltacloud_metric_info_t	*cloud_metric_info_get(zbx_deltacloud_service_t *service, const char *instance_id)
+{
+	zbx_deltacloud_metric_info_t	metric_info_local;
+
+	if (NULL == instance_id)
+		return NULL;
+
+	metric_info_local.instance_id = (char *)instance_id;
+
+	return zbx_hashset_search(&service->metric_infos, &metric_info_local);
+}
+
+/******************************************************************************
+ *                                                                            *
+ * Function: cloud_metric_info_register                                       *
+ *                                                                            *
+ * Purpose: return the metric set of an instance, adding an empty one so the  *
+ *          collector starts refreshing the instance                          *
+ *                                                                            *
+ * Comment: the collector refreshes metrics only for the registered           *
+ *          instances, the caller holds the write lock                        *
+ *                                                                            *
+ ******************************************************************************/
+static zbx_deltacloud_metric_info_t	*cloud_metric_info_register(zbx_deltacloud_service_t *service,
+		const char *instance_id)
+{
+	zbx_deltacloud_metric_info_t	metric_info_local, *metric_info;
+
+	if (NULL != (metric_info = cloud_metric_info_get(service, instance_id)))
+		return metric_info;
+
+	/* init metric_info, the hashset keeps exactly one entry per instance */
+	memset(&metric_info_local, 0, sizeof(metric_info_local));
+	metric_info_local.instance_id = cloud_shared_strdup(instance_id);
+	metric_info = zbx_hashset_insert(&service->metric_infos, &metric_info_local, sizeof(metric_info_local));
+	CLOUD_VECTOR_CREATE(&metric_info->metrics, ptr);
+	CLOUD_INDEX_CREATE(&metric_info->metrics_index);
+
+	return metric_info;
+}
+
+static void	cloud_metric_info_remove(zbx_deltacloud_service_t *service, zbx_deltacloud_metric_info_t *metric_info)
+{
+	zbx_deltacloud_metric_info_t	metric_info_local;
+
+	if (NULL == metric_info)
+		return;
+
+	/* the clean frees the key, so the entry is removed first and its copy is cleaned */
+	metric_info_local = *metric_info;
+	zbx_hashset_remove(&service->metric_infos, &metric_info_local);
+	cloud_metric_info_shared_clean(&metric_info_local);
+}
+
+static void	cloud_json_addfield(struct zbx_json *json, const char *name, const char *value)
+{
+	if (NULL != value)
+		zbx_json_addstring(json, name, value, ZBX_JSON_TYPE_STRING);
+}
+
+static char	*cloud_strdup_result(const char *value)
+{
+	return strdup(NULL != value ? value : "");
+}
+
+/******************************************************************************
+ *                                                                            *
+ * Function: cloud_lld_set                                                    *
+ *                                                                            *
+ * Purpose: store a rendered LLD document in cloud_mem                        *
+ *                                                                            *
+ * Comment: the documents are rendered by the collector when the discovered   *
+ *          set may have changed, the discovery items only copy them. A       *
+ *          document with the same hash and content is kept as it is.         *
+ *                                                                            *
+ ******************************************************************************/
+static void	cloud_lld_set(char **lld, zbx_hash_t *lld_hash, const struct zbx_json *json)
+{
+	zbx_hash_t	hash;
+
+	hash = ZBX_DEFAULT_STRING_HASH_ALGO(json->buffer, json->buffer_size, ZBX_DEFAULT_HASH_SEED);
+
+	if (NULL != *lld)
+	{
+		if (hash == *lld_hash && 0 == strcmp(*lld, json->buffer))
+			return;
+
+		__cloud_mem_free_func(*lld);
+	}
+
+	*lld = cloud_shared_strdup(json->buffer);
+	*lld_hash = hash;
+}
+
+/* renders cloud.instance.discovery of a service, the caller holds the write lock */
+static void	cloud_instance_lld_update(zbx_deltacloud_service_t *service)
+{
+	int	i;
+	char	*addresses;
+	struct zbx_json	json;
+	zbx_deltacloud_instance_t	*deltacloud_instance;
+
+	zbx_json_init(&json, ZBX_JSON_STAT_BUF_LEN);
+	zbx_json_addarray(&json, ZBX_PROTO_TAG_DATA);
+
+	for (i = 0; i < service->instances.values_num; i++)
+	{
+		deltacloud_instance = service->instances.values[i];
+
+		zbx_json_addobject(&json, NULL);
+		cloud_json_addfield(&json, NAME_MACRO, cloud_instance_str(deltacloud_instance, CLOUD_INSTANCE_NAME));
+		cloud_json_addfield(&json, ID_MACRO, cloud_instance_str(deltacloud_instance, CLOUD_INSTANCE_ID));
+		cloud_json_addfield(&json, PUBLIC_ADDR_MACRO,
+				cloud_instance_str(deltacloud_instance, CLOUD_INSTANCE_PUBLIC_ADDR));
+		cloud_json_addfield(&json, PRIVATE_ADDR_MACRO,
+				cloud_instance_str(deltacloud_instance, CLOUD_INSTANCE_PRIVATE_ADDR));
+
+		addresses = cloud_instance_addresses(deltacloud_instance, CLOUD_INSTANCE_PUBLIC_ADDR);
+		zbx_json_addstring(&json, PUBLIC_ADDRS_MACRO, addresses, ZBX_JSON_TYPE_STRING);
+		zbx_free(addresses);
+
+		addresses = cloud_instance_addresses(deltacloud_instance, CLOUD_INSTANCE_PRIVATE_ADDR);
+		zbx_json_addstring(&json, PRIVATE_ADDRS_MACRO, addresses, ZBX_JSON_TYPE_STRING);
+		zbx_free(addresses);
+
+		zbx_json_close(&json);
+	}
+
+	cloud_lld_set(&service->lld, &service->lld_hash, &json);
+	zbx_json_free(&json);
+}
+
+/* renders cloud.metric.discovery of an instance, the caller holds the write lock */
+static void	cloud_metric_lld_update(zbx_deltacloud_metric_info_t *metric_info)
+{
+	int	i;
+	struct zbx_json	json;
+	zbx_deltacloud_metric_t	*metric;
+
+	zbx_json_init(&json, ZBX_JSON_STAT_BUF_LEN);
+	zbx_json_addarray(&json, ZBX_PROTO_TAG_DATA);
+
+	for (i = 0; i < metric_info->metrics.values_num; i++)
+	{
+		metric = metric_info->metrics.values[i];
+
+		if (NULL == metric->name)
+			continue;
+
+		zbx_json_addobject(&json, NULL);
+		zbx_json_addstring(&json, METRIC_NAME_MACRO, metric->name, ZBX_JSON_TYPE_STRING);
+		if (-1 != metric->metric_value.unit)
+		{
+			zbx_json_addstring(&json, METRIC_UNIT_MACRO, deltacloud->units.values[metric->metric_value.unit],
+					ZBX_JSON_TYPE_STRING);
+		}
+		zbx_json_close(&json);
+	}
+
+	cloud_lld_set(&metric_info->lld, &metric_info->lld_hash, &json);
+	zbx_json_free(&json);
+}
+
+int	zbx_module_cloud_instance_discovery(AGENT_REQUEST *request, AGENT_RESULT *result)
+{
+	char	*url;
+	char	*key;
+	char	*secret;
+	char	*driver;
+	char	*provider;
+	zbx_deltacloud_service_t	*service = NULL;
+
+	if (request->nparam != 5)
+	{
+		/* set optional error message */
+		SET_MSG_RESULT(result, strdup("Invalid number of parameters e.g.) cloud.instance.discovery[url, key, secret, driver, provider]"));
+		return SYSINFO_RET_FAIL;
+	}
+	cloud_trace_begin(request);
+
+	url = get_rparam(request, 0);
+	key = get_rparam(request, 1);
+	secret = get_rparam(request, 2);
+	driver = get_rparam(request, 3);
+	provider = get_rparam(request, 4);
+
+	service = cloud_service_acquire(url, key, secret, driver, provider);
+
+	if (NULL == service)
+	{
+		cloud_rdunlock();
+		cloud_item_done(CLOUD_STATS_INSTANCE_DISCOVERY, FAIL);
+		SET_MSG_RESULT(result, strdup("Instances are not collected yet"));
+		return SYSINFO_RET_FAIL;
+	}
+
+	if (0 == service->lastcheck)
+	{
+		/* the collector has not fetched this service yet, do not report an empty list to LLD */
+		cloud_rdunlock();
+		cloud_item_done(CLOUD_STATS_INSTANCE_DISCOVERY, FAIL);
+		SET_MSG_RESULT(result, strdup("Instances are not collected yet"));
+		return SYSINFO_RET_FAIL;
+	}
+
+	cloud_item_done(CLOUD_STATS_INSTANCE_DISCOVERY, SUCCEED);
+	SET_STR_RESULT(result, strdup(service->lld));
+
+	cloud_rdunlock();
+
+	return SYSINFO_RET_OK;
+}
+
+int	zbx_module_cloud_instance_info(AGENT_REQUEST *request, AGENT_RESULT *result)
+{
+	int	ret = SYSINFO_RET_FAIL;
+	char	*url;
+	char	*key;
+	char	*secret;
+	char	*driver;
+	char	*provider;
+	char	*instance_id;
+	char	*element;
+	
+	zbx_deltacloud_service_t	*service = NULL;
+	zbx_deltacloud_instance_t	*instance = NULL;
+
+	if (request->nparam != 7)
+	{
+		/* set optional error message */
+		SET_MSG_RESULT(result, strdup("Invalid number of parameters e.g.) cloud.instane.info[url, key, secret, driver, provider, instance_id, element]"));
+		return SYSINFO_RET_FAIL;
+	}
+	cloud_trace_begin(request);
+
+	url = get_rparam(request, 0);
+	key = get_rparam(request, 1);
+	secret = get_rparam(request, 2);
+	driver = get_rparam(request, 3);
+	provider = get_rparam(request, 4);
+	instance_id = get_rparam(request, 5);
+	element = get_rparam(request, 6);
+
+	service = cloud_service_acquire(url, key, secret, driver, provider);
+
+	if (NULL == service)
+	{
+		cloud_rdunlock();
+		cloud_item_done(CLOUD_STATS_INSTANCE_INFO, FAIL);
+		SET_MSG_RESULT(result, strdup("No Data"));
+		return SYSINFO_RET_FAIL;
+	}
+	
+	if (NULL == (instance = cloud_index_get(&service->instances_index, instance_id)))
+	{
+		cloud_item_done(CLOUD_STATS_INSTANCE_INFO, FAIL);
+		SET_MSG_RESULT(result, strdup("Not match data"));
+	}
+	else
+	{
+		cloud_item_done(CLOUD_STATS_INSTANCE_INFO, SUCCEED);
+		ret = SYSINFO_RET_OK;
+
+		if (0 == strcmp(element, "state"))
+			SET_STR_RESULT(result, cloud_strdup_result(instance->state));
+		else if (0 == strcmp(element, "owner_id"))
+			SET_STR_RESULT(result, cloud_strdup_result(instance->owner_id));
+		else if (0 == strcmp(element, "image_id"))
+			SET_STR_RESULT(result, cloud_strdup_result(instance->image_id));
+		else if (0 == strcmp(element, "image_href"))
+			SET_STR_RESULT(result, cloud_strdup_result(instance->image_href));
+		else if (0 == strcmp(element, "realm_id"))
+			SET_STR_RESULT(result, cloud_strdup_result(instance->realm_id));
+		else if (0 == strcmp(element, "realm_href"))
+			SET_STR_RESULT(result, cloud_strdup_result(instance->realm_href));
+		else if (0 == strcmp(element, "launch_time"))
+			SET_STR_RESULT(result, cloud_strdup_result(cloud_instance_str(instance, CLOUD_INSTANCE_LAUNCH_TIME)));
+		else if (0 == strcmp(element, "hwp_href"))
+			SET_STR_RESULT(result, cloud_strdup_result(instance->hwp.href));
+		else if (0 == strcmp(element, "hwp_id"))
+			SET_STR_RESULT(result, cloud_strdup_result(instance->hwp.id));
+		else if (0 == strcmp(element, "hwp_name"))
+			SET_STR_RESULT(result, cloud_strdup_result(instance->hwp.name));
+		else if (0 == strcmp(element, "public_addr"))
+			SET_STR_RESULT(result, cloud_strdup_result(cloud_instance_str(instance, CLOUD_INSTANCE_PUBLIC_ADDR)));
+		else if (0 == strcmp(element, "private_addr"))
+			SET_STR_RESULT(result, cloud_strdup_result(cloud_instance_str(instance, CLOUD_INSTANCE_PRIVATE_ADDR)));
+		else if (0 == strcmp(element, "public_addrs"))
+			SET_STR_RESULT(result, cloud_instance_addresses(instance, CLOUD_INSTANCE_PUBLIC_ADDR));
+		else if (0 == strcmp(element, "private_addrs"))
+			SET_STR_RESULT(result, cloud_instance_addresses(instance, CLOUD_INSTANCE_PRIVATE_ADDR));
+		else{
+			SET_MSG_RESULT(result, strdup("Unsupported element"));
+			ret = SYSINFO_RET_FAIL;
+		}
+	}
+
+	cloud_rdunlock();
+
+	return ret;
+}
+
+static void	cloud_json_addaddresses(struct zbx_json *json, const char *name,
+		const zbx_deltacloud_instance_t *instance, int field)
+{
+	const char	*address = cloud_instance_str(instance, field);
+	int		i;
+
+	zbx_json_addarray(json, name);
+
+	for (i = 0; i < cloud_instance_addresses_num(instance, field); i++, address += strlen(address) + 1)
+		zbx_json_addstring(json, NULL, address, ZBX_JSON_TYPE_STRING);
+
+	zbx_json_close(json);
+}
+
+/******************************************************************************
+ *                                                                            *
+ * Function: cloud_instance_json_add                                          *
+ *                                                                            *
+ * Purpose: add an instance as a JSON object, members are named after the     *
+ *          cloud.instance.info elements                                      *
+ *                                                                            *
+ ******************************************************************************/
+static void	cloud_instance_json_add(struct zbx_json *json, const char *name,
+		const zbx_deltacloud_instance_t *instance)
+{
+	zbx_json_addobject(json, name);
+	cloud_json_addfield(json, "name", cloud_instance_str(instance, CLOUD_INSTANCE_NAME));
+	cloud_json_addfield(json, "state", instance->state);
+	cloud_json_addfield(json, "owner_id", instance->owner_id);
+	cloud_json_addfield(json, "image_id", instance->image_id);
+	cloud_json_addfield(json, "image_href", instance->image_href);
+	cloud_json_addfield(json, "realm_id", instance->realm_id);
+	cloud_json_addfield(json, "realm_href", instance->realm_href);
+	cloud_json_addfield(json, "launch_time", cloud_instance_str(instance, CLOUD_INSTANCE_LAUNCH_TIME));
+	cloud_json_addfield(json, "hwp_href", instance->hwp.href);
+	cloud_json_addfield(json, "hwp_id", instance->hwp.id);
+	cloud_json_addfield(json, "hwp_name", instance->hwp.name);
+	cloud_json_addfield(json, "public_addr", cloud_instance_str(instance, CLOUD_INSTANCE_PUBLIC_ADDR));
+	cloud_json_addfield(json, "private_addr", cloud_instance_str(instance, CLOUD_INSTANCE_PRIVATE_ADDR));
+	cloud_json_addaddresses(json, "public_addrs", instance, CLOUD_INSTANCE_PUBLIC_ADDR);
+	cloud_json_addaddresses(json, "private_addrs", instance, CLOUD_INSTANCE_PRIVATE_ADDR);
+	zbx_json_close(json);
+}
+
+/******************************************************************************
+ *                                                                            *
+ * Function: zbx_module_cloud_instance_info_all                               *
+ *                                                                            *
+ * Purpose: return every cached instance, or one instance if its id is given, *
+ *          as JSON keyed by instance id                                      *
+ *                                                                            *
+ ******************************************************************************/
+int	zbx_module_cloud_instance_info_all(AGENT_REQUEST *request, AGENT_RESULT *result)
+{
+	int	i, ret = SYSINFO_RET_OK;
+	struct zbx_json json;
+	char	*url;
+	char	*key;
+	char	*secret;
+	char	*driver;
+	char	*provider;
+	char	*instance_id = NULL;
+
+	zbx_deltacloud_service_t	*service = NULL;
+	zbx_deltacloud_instance_t	*instance = NULL;
+
+	if (request->nparam != 5 && request->nparam != 6)
+	{
+		/* set optional error message */
+		SET_MSG_RESULT(result, strdup("Invalid number of parameters e.g.) cloud.instance.info.all[url, key, secret, driver, provider, <instance_id>]"));
+		return SYSINFO_RET_FAIL;
+	}
+	cloud_trace_begin(request);
+
+	url = get_rparam(request, 0);
+	key = get_rparam(request, 1);
+	secret = get_rparam(request, 2);
+	driver = get_rparam(request, 3);
+	provider = get_rparam(request, 4);
+	if (6 == request->nparam && '\0' != *get_rparam(request, 5))
+		instance_id = get_rparam(request, 5);
+
+	service = cloud_service_acquire(url, key, secret, driver, provider);
+
+	if (NULL == service)
+	{
+		cloud_rdunlock();
+		cloud_item_done(CLOUD_STATS_INSTANCE_INFO_ALL, FAIL);
+		SET_MSG_RESULT(result, strdup("Instances are not collected yet"));
+		return SYSINFO_RET_FAIL;
+	}
+
+	if (0 == service->lastcheck)
+	{
+		cloud_rdunlock();
+		cloud_item_done(CLOUD_STATS_INSTANCE_INFO_ALL, FAIL);
+		SET_MSG_RESULT(result, strdup("Instances are not collected yet"));
+		return SYSINFO_RET_FAIL;
+	}
+
+	zbx_json_init(&json, ZBX_JSON_STAT_BUF_LEN);
+
+	if (NULL != instance_id)
+	{
+		if (NULL == (instance = cloud_index_get(&service->instances_index, instance_id)))
+			ret = SYSINFO_RET_FAIL;
+		else
+			cloud_instance_json_add(&json, instance_id, instance);
+	}
+	else
+	{
+		for (i = 0; i < service->instances.values_num; i++)
+		{
+			const char	*id;
+
+			instance = service->instances.values[i];
+
+			if (NULL != (id = cloud_instance_str(instance, CLOUD_INSTANCE_ID)))
+				cloud_instance_json_add(&json, id, instance);
+		}
+	}
+
+	cloud_rdunlock();
+
+	if (SYSINFO_RET_OK == ret)
+	{
+		cloud_item_done(CLOUD_STATS_INSTANCE_INFO_ALL, SUCCEED);
+		SET_STR_RESULT(result, strdup(json.buffer));
+	}
+	else
+	{
+		cloud_item_done(CLOUD_STATS_INSTANCE_INFO_ALL, FAIL);
+		SET_MSG_RESULT(result, strdup("Not match data"));
+	}
+
+	zbx_json_free(&json);
+
+	return ret;
+}
+
+int	zbx_module_cloud_metric_discovery(AGENT_REQUEST *request, AGENT_RESULT *result)
+{
+	char	*url;
+	char	*key;
+	char	*secret;
+	char	*driver;
+	char	*provider;
+	char	*instance_id;
+	
+	zbx_deltacloud_service_t	*service = NULL;
+	zbx_deltacloud_metric_info_t	*metric_info = NULL;
+
+	if (request->nparam != 6)
+	{
+		/* set optional error message */
+		SET_MSG_RESULT(result, strdup("Invalid number of parameters e.g.) cloud.metric.discovery[url, key, secret, driver, provider, instance_id]"));
+		return SYSINFO_RET_FAIL;
+	}
+	cloud_trace_begin(request);
+
+	url = get_rparam(request, 0);
+	key = get_rparam(request, 1);
+	secret = get_rparam(request, 2);
+	driver = get_rparam(request, 3);
+	provider = get_rparam(request, 4);
+	instance_id = get_rparam(request, 5);
+
+	service = cloud_service_acquire(url, key, secret, driver, provider);
+
+	if (NULL == service)
+	{
+		cloud_rdunlock();
+		cloud_item_done(CLOUD_STATS_METRIC_DISCOVERY, FAIL);
+		SET_MSG_RESULT(result, strdup("No Data"));
+		return SYSINFO_RET_FAIL;
+	}
+
+	if (NULL == (metric_info = cloud_metric_info_get(service, instance_id)))
+	{
+		/* registering the instance allocates in cloud_mem, only the first call takes the write lock */
+		cloud_rdunlock();
+		cloud_wrlock();
+
+		if (NULL != (service = zbx_deltacloud_get_service(url, key, secret, driver, provider)))
+			cloud_metric_info_register(service, instance_id)->lastaccess = time(NULL);
+
+		cloud_wrunlock();
+		cloud_item_done(CLOUD_STATS_METRIC_DISCOVERY, FAIL);
+		SET_MSG_RESULT(result, strdup("Metrics are not collected yet"));
+		return SYSINFO_RET_FAIL;
+	}
+
+	metric_info->lastaccess = time(NULL);
+
+	if (0 == metric_info->lastcheck)
+	{
+		cloud_rdunlock();
+		cloud_item_done(CLOUD_STATS_METRIC_DISCOVERY, FAIL);
+		SET_MSG_RESULT(result, strdup("Metrics are not collected yet"));
+		return SYSINFO_RET_FAIL;
+	}
+
+	SET_STR_RESULT(result, strdup(metric_info->lld));
+
+	cloud_rdunlock();
+	cloud_item_done(CLOUD_STATS_METRIC_DISCOVERY, SUCCEED);
+
+	return SYSINFO_RET_OK;
+}
+
+int	zbx_module_cloud_metric(AGENT_REQUEST *request, AGENT_RESULT *result)
+{
+	int	ret = SYSINFO_RET_FAIL;
+	char	*url;
+	char	*key;
+	char	*secret;
+	char	*driver;
+	char	*provider;
+	char	*instance_id;
+	char	*metric_name;
+	char	*mode;
+	
+	zbx_deltacloud_service_t	*service = NULL;
+	zbx_deltacloud_metric_info_t	*metric_info = NULL;
+	zbx_deltacloud_metric_t	*metric = NULL;
+
+	if (request->nparam != 8)
+	{
+		/* set optional error message */
+		SET_MSG_RESULT(result, strdup("Invalid number of parameters e.g.) cloud.metric[url, key, secret, driver, provider, instance_id, metric, mode]"));
+		return SYSINFO_RET_FAIL;
+	}
+	cloud_trace_begin(request);
+
+	url = get_rparam(request, 0);
+	key = get_rparam(request, 1);
+	secret = get_rparam(request, 2);
+	driver = get_rparam(request, 3);
+	provider = get_rparam(request, 4);
+	instance_id = get_rparam(request, 5);
+	metric_name = get_rparam(request, 6);
+	mode = get_rparam(request, 7);
+
+	service = cloud_service_acquire(url, key, secret, driver, provider);
+
+	if (NULL == service)
+	{
+		cloud_rdunlock();
+		cloud_item_done(CLOUD_STATS_METRIC, FAIL);
+		SET_MSG_RESULT(result, strdup("No Data"));
+		return SYSINFO_RET_FAIL;
+	}
+
+	if (NULL == (metric_info = cloud_metric_info_get(service, instance_id)))
+	{
+		cloud_rdunlock();
+		cloud_item_done(CLOUD_STATS_METRIC, FAIL);
+		SET_MSG_RESULT(result, strdup("No metric data"));
+		return SYSINFO_RET_FAIL;
+	}
+
+	metric_info->lastaccess = time(NULL);
+
+	if (NULL == (metric = cloud_index_get(&metric_info->metrics_index, metric_name)))
+	{
+		cloud_item_done(CLOUD_STATS_METRIC, FAIL);
+		SET_MSG_RESULT(result, strdup("Not match data"));
+	}
+	else
+	{
+		cloud_item_done(CLOUD_STATS_METRIC, SUCCEED);
+		ret = SYSINFO_RET_OK;
+
+		zbx_deltacloud_metric_value_t	*value = &metric->metric_value;
+
+		if (0 != (value->flags & CLOUD_METRIC_MINIMUM) && 0 == strcmp(mode, "minimum"))
+		{
+			SET_DBL_RESULT(result, value->minimum);
+		}else if (0 != (value->flags & CLOUD_METRIC_MAXIMUM) && 0 == strcmp(mode, "maximum"))
+		{
+			SET_DBL_RESULT(result, value->maximum);
+		}else if (0 != (value->flags & CLOUD_METRIC_SAMPLES) && 0 == strcmp(mode, "samples"))
+		{
+			SET_DBL_RESULT(result, value->samples);
+		}else if (0 != (value->flags & CLOUD_METRIC_AVERAGE) && 0 == strcmp(mode, "average"))
+		{
+			SET_DBL_RESULT(result, value->average);
+		}else
+		{
+			SET_MSG_RESULT(result, strdup("Not match date mode"));
+			ret = SYSINFO_RET_FAIL;
+		}
+	}
+
+	cloud_rdunlock();
+
+	return ret;
+}
+
+/* adds a number in its shortest form, JSON has no NaN and infinity so such values are left out */
+static void	cloud_json_adddouble(struct zbx_json *json, const char *name, double value)
+{
+	char	buffer[MAX_STRING_LEN];
+
+	if (0 == isfinite(value))
+		return;
+
+	zbx_snprintf(buffer, sizeof(buffer), "%.15g", value);
+	zbx_json_addstring(json, name, buffer, ZBX_JSON_TYPE_INT);
+}
+
+/******************************************************************************
+ *                                                                            *
+ * Function: zbx_module_cloud_metric_all                                      *
+ *                                                                            *
+ * Purpose: return every collected metric of an instance in one JSON object   *
+ *                                                                            *
+ * Comment: the result looks like                                             *
+ *          {"CPUUtilization":{"unit":"Percent","average":1.5,...},...}       *
+ *          so one item can feed the others through JSON preprocessing        *
+ *                                                                            *
+ ******************************************************************************/
+int	zbx_module_cloud_metric_all(AGENT_REQUEST *request, AGENT_RESULT *result)
+{
+	int	i;
+	struct zbx_json json;
+	char	*url;
+	char	*key;
+	char	*secret;
+	char	*driver;
+	char	*provider;
+	char	*instance_id;
+
+	zbx_deltacloud_service_t	*service = NULL;
+	zbx_deltacloud_metric_info_t	*metric_info = NULL;
+
+	if (request->nparam != 6)
+	{
+		/* set optional error message */
+		SET_MSG_RESULT(result, strdup("Invalid number of parameters e.g.) cloud.metric.all[url, key, secret, driver, provider, instance_id]"));
+		return SYSINFO_RET_FAIL;
+	}
+	cloud_trace_begin(request);
+
+	url = get_rparam(request, 0);
+	key = get_rparam(request, 1);
+	secret = get_rparam(request, 2);
+	driver = get_rparam(request, 3);
+	provider = get_rparam(request, 4);
+	instance_id = get_rparam(request, 5);
+
+	service = cloud_service_acquire(url, key, secret, driver, provider);
+
+	if (NULL == service)
+	{
+		cloud_rdunlock();
+		cloud_item_done(CLOUD_STATS_METRIC_ALL, FAIL);
+		SET_MSG_RESULT(result, strdup("No Data"));
+		return SYSINFO_RET_FAIL;
+	}
+
+	if (NULL == (metric_info = cloud_metric_info_get(service, instance_id)))
+	{
+		/* the first call registers the instance, as cloud.metric.discovery does */
+		cloud_rdunlock();
+		cloud_wrlock();
+
+		if (NULL != (service = zbx_deltacloud_get_service(url, key, secret, driver, provider)))
+			cloud_metric_info_register(service, instance_id)->lastaccess = time(NULL);
+
+		cloud_wrunlock();
+		cloud_item_done(CLOUD_STATS_METRIC_ALL, FAIL);
+		SET_MSG_RESULT(result, strdup("Metrics are not collected yet"));
+		return SYSINFO_RET_FAIL;
+	}
+
+	metric_info->lastaccess = time(NULL);
+
+	if (0 == metric_info->lastcheck)
+	{
+		cloud_rdunlock();
+		cloud_item_done(CLOUD_STATS_METRIC_ALL, FAIL);
+		SET_MSG_RESULT(result, strdup("Metrics are not collected yet"));
+		return SYSINFO_RET_FAIL;
+	}
+
+	zbx_json_init(&json, ZBX_JSON_STAT_BUF_LEN);
+
+	for (i = 0; i < metric_info->metrics.values_num; i++)
+	{
+		zbx_deltacloud_metric_t		*metric = metric_info->metrics.values[i];
+		zbx_deltacloud_metric_value_t	*value = &metric->metric_value;
+
+		if (NULL == metric->name)
+			continue;
+
+		zbx_json_addobject(&json, metric->name);
+		if (-1 != value->unit)
+			zbx_json_addstring(&json, "unit", deltacloud->units.values[value->unit], ZBX_JSON_TYPE_STRING);
+		if (0 != (value->flags & CLOUD_METRIC_MINIMUM))
+			cloud_json_adddouble(&json, "minimum", value->minimum);
+		if (0 != (value->flags & CLOUD_METRIC_MAXIMUM))
+			cloud_json_adddouble(&json, "maximum", value->maximum);
+		if (0 != (value->flags & CLOUD_METRIC_SAMPLES))
+			cloud_json_adddouble(&json, "samples", value->samples);
+		if (0 != (value->flags & CLOUD_METRIC_AVERAGE))
+			cloud_json_adddouble(&json, "average", value->average);
+		zbx_json_close(&json);
+	}
+
+	cloud_rdunlock();
+
+	cloud_item_done(CLOUD_STATS_METRIC_ALL, SUCCEED);
+	SET_STR_RESULT(result, strdup(json.buffer));
+	zbx_json_free(&json);
+
+	return SYSINFO_RET_OK;
+}
+
+/* writes a counter to the JSON document or picks the one asked for */
+typedef struct
+{
+	struct zbx_json	*json;
+	const char	*name;
+	zbx_uint64_t	value;
+	int		found;
+}
+zbx_cloud_stats_out_t;
+
+static void	cloud_stats_out(zbx_cloud_stats_out_t *out, const char *name, zbx_uint64_t value)
+{
+	if (NULL != out->json)
+	{
+		zbx_json_adduint64(out->json, name, value);
+	}
+	else if (0 == strcmp(name, out->name))
+	{
+		out->value = value;
+		out->found = 1;
+	}
+}
+
+static void	cloud_stats_out_buckets(zbx_cloud_stats_out_t *out, const char *prefix, const char **names,
+		const zbx_uint64_t *buckets, zbx_uint64_t sum_ms)
+{
+	int	i;
+	char	name[MAX_STRING_LEN];
+
+	for (i = 0; i < CLOUD_STATS_BUCKETS_NUM; i++)
+	{
+		zbx_snprintf(name, sizeof(name), "%s.%s", prefix, names[i]);
+		cloud_stats_out(out, name, buckets[i]);
+	}
+
+	zbx_snprintf(name, sizeof(name), "%s.sum_ms", prefix);
+	cloud_stats_out(out, name, sum_ms);
+}
+
+/******************************************************************************
+ *                                                                            *
+ * Function: cloud_stats_collect                                              *
+ *                                                                            *
+ * Purpose: pass the module counters and the cache contents to out           *
+ *                                                                            *
+ * Comment: the memory of each object type counts the records and their      *
+ *          strings, without the allocator and hashset overhead included in   *
+ *          memory.used. The caller holds the read lock.                      *
+ *                                                                            *
+ ******************************************************************************/
+static void	cloud_stats_collect(zbx_cloud_stats_out_t *out)
+{
+	int	i;
+	char	name[MAX_STRING_LEN];
+	zbx_uint64_t	instances = 0, metric_infos = 0, metrics = 0;
+	zbx_uint64_t	services_size = 0, instances_size = 0, metrics_size = 0, lld_size = 0, strings_size = 0;
+	zbx_hashset_iter_t	iter, metric_info_iter;
+	zbx_deltacloud_service_t	*service;
+	zbx_deltacloud_metric_info_t	*metric_info;
+	const zbx_cloud_stats_t	*stats = &deltacloud->stats;
+	const char	*str;
+
+	for (i = 0; i < CLOUD_STATS_KEYS_NUM; i++)
+	{
+		zbx_snprintf(name, sizeof(name), "%s.hits", keys[i].key);
+		cloud_stats_out(out, name, stats->hits[i]);
+		zbx_snprintf(name, sizeof(name), "%s.misses", keys[i].key);
+		cloud_stats_out(out, name, stats->misses[i]);
+	}
+
+	cloud_stats_out(out, "api.connects", stats->api_connects);
+	cloud_stats_out(out, "api.instance_requests", stats->api_instance_requests);
+	cloud_stats_out(out, "api.metric_requests", stats->api_metric_requests);
+	cloud_stats_out(out, "api.errors", stats->api_errors);
+	cloud_stats_out(out, "api.throttled", stats->api_throttled);
+	cloud_stats_out_buckets(out, "api.latency", cloud_stats_latency_names, stats->api_latency,
+			stats->api_latency_ms);
+	cloud_stats_out(out, "refreshes", stats->refreshes);
+	cloud_stats_out_buckets(out, "refresh.duration", cloud_stats_duration_names, stats->refresh_duration,
+			stats->refresh_duration_ms);
+
+	zbx_hashset_iter_reset(&deltacloud->services, &iter);
+	while (NULL != (service = zbx_hashset_iter_next(&iter)))
+	{
+		services_size += sizeof(zbx_deltacloud_service_t) + strlen(service->url) + strlen(service->key) +
+				strlen(service->driver) + strlen(service->provider) + 4 + service->secret_len;
+
+		if (NULL != service->lld)
+			lld_size += strlen(service->lld) + 1;
+
+		instances += service->instances.values_num;
+
+		for (i = 0; i < service->instances.values_num; i++)
+			instances_size += cloud_instance_size(service->instances.values[i]);
+
+		metric_infos += service->metric_infos.num_data;
+
+		zbx_hashset_iter_reset(&service->metric_infos, &metric_info_iter);
+		while (NULL != (metric_info = zbx_hashset_iter_next(&metric_info_iter)))
+		{
+			metrics += metric_info->metrics.values_num;
+			metrics_size += sizeof(zbx_deltacloud_metric_info_t) + strlen(metric_info->instance_id) + 1 +
+					metric_info->metrics.values_num * sizeof(zbx_deltacloud_metric_t);
+
+			if (NULL != metric_info->lld)
+				lld_size += strlen(metric_info->lld) + 1;
+		}
+	}
+
+	zbx_hashset_iter_reset(&deltacloud->strpool, &iter);
+	while (NULL != (str = zbx_hashset_iter_next(&iter)))
+		strings_size += REFCOUNT_FIELD_SIZE + strlen(str + REFCOUNT_FIELD_SIZE) + 1;
+
+	cloud_stats_out(out, "services", deltacloud->services.num_data);
+	cloud_stats_out(out, "instances", instances);
+	cloud_stats_out(out, "metric_sets", metric_infos);
+	cloud_stats_out(out, "metrics", metrics);
+
+	cloud_stats_out(out, "memory.total", cloud_mem->total_size);
+	cloud_stats_out(out, "memory.used", cloud_mem->used_size);
+	cloud_stats_out(out, "memory.free", cloud_mem->free_size);
+	cloud_stats_out(out, "memory.services", services_size);
+	cloud_stats_out(out, "memory.instances", instances_size);
+	cloud_stats_out(out, "memory.metrics", metrics_size);
+	cloud_stats_out(out, "memory.lld", lld_size);
+	cloud_stats_out(out, "memory.strings", strings_size);
+}
+
+int	zbx_module_cloud_module_stats(AGENT_REQUEST *request, AGENT_RESULT *result)
+{
+	struct zbx_json	json;
+	zbx_cloud_stats_out_t	out;
+
+	if (1 < request->nparam)
+	{
+		/* set optional error message */
+		SET_MSG_RESULT(result, strdup("Invalid number of parameters e.g.) cloud.module.stats[<counter>]"));
+		return SYSINFO_RET_FAIL;
+	}
+
+	memset(&out, 0, sizeof(out));
+
+	/* without a counter name every counter is returned in one JSON object */
+	if (1 == request->nparam && '\0' != *get_rparam(request, 0))
+		out.name = get_rparam(request, 0);
+	else
+	{
+		zbx_json_init(&json, ZBX_JSON_STAT_BUF_LEN);
+		out.json = &json;
+	}
+
+	cloud_rdlock();
+	cloud_stats_collect(&out);
+	cloud_rdunlock();
+
+	if (NULL != out.json)
+	{
+		SET_STR_RESULT(result, strdup(json.buffer));
+		zbx_json_free(&json);
+		return SYSINFO_RET_OK;
+	}
+
+	if (0 == out.found)
+	{
+		SET_MSG_RESULT(result, strdup("Unsupported counter"));
+		return SYSINFO_RET_FAIL;
+	}
+
+	SET_UI64_RESULT(result, out.value);
+
+	return SYSINFO_RET_OK;
+}
+
+/******************************************************************************
+ *                                                                            *
+ * Function: zbx_module_cloud_module_trace                                    *
+ *                                                                            *
+ * Purpose: return the last traced item calls, oldest first                   *
+ *                                                                            *
+ ******************************************************************************/
+int	zbx_module_cloud_module_trace(AGENT_REQUEST *request, AGENT_RESULT *result)
+{
+	int	count = CONFIG_MODULE_TRACE_SIZE;
+	char	*param;
+	zbx_uint32_t	next, num;
+	zbx_cloud_trace_event_t	event;
+	struct zbx_json	json;
+
+	if (1 < request->nparam)
+	{
+		/* set optional error message */
+		SET_MSG_RESULT(result, strdup("Invalid number of parameters e.g.) cloud.module.trace[<count>]"));
+		return SYSINFO_RET_FAIL;
+	}
+
+	if (1 == request->nparam && '\0' != *(param = get_rparam(request, 0)))
+	{
+		if (SUCCEED != is_uint31(param, &count) || 0 == count)
+		{
+			SET_MSG_RESULT(result, strdup("Invalid count"));
+			return SYSINFO_RET_FAIL;
+		}
+	}
+
+	if (NULL == deltacloud->trace)
+	{
+		SET_MSG_RESULT(result, strdup("Tracing is disabled, set ModuleTraceSize"));
+		return SYSINFO_RET_FAIL;
+	}
+
+	if (count > CONFIG_MODULE_TRACE_SIZE)
+		count = CONFIG_MODULE_TRACE_SIZE;
+
+	/* counted modulo 2^32, slots not written yet have sequence number 0 and are skipped */
+	next = deltacloud->trace_next;
+	num = next - (zbx_uint32_t)count;
+
+	zbx_json_init(&json, ZBX_JSON_STAT_BUF_LEN);
+	zbx_json_addarray(&json, "events");
+
+	for (; num != next; num++)
+	{
+		event = deltacloud->trace[num & (CONFIG_MODULE_TRACE_SIZE - 1)];
+		__sync_synchronize();
+
+		/* overwritten by a newer event or still being written */
+		if (0 == event.seq || num + 1 != event.seq ||
+				num + 1 != deltacloud->trace[num & (CONFIG_MODULE_TRACE_SIZE - 1)].seq)
+		{
+			continue;
+		}
+
+		zbx_json_addobject(&json, NULL);
+		zbx_json_adduint64(&json, "clock", event.clock);
+		zbx_json_adduint64(&json, "pid", event.pid);
+		zbx_json_addstring(&json, "key", keys[event.key].key, ZBX_JSON_TYPE_STRING);
+		zbx_json_adduint64(&json, "hash", event.hash);
+		zbx_json_adduint64(&json, "duration_us", event.duration_us);
+		zbx_json_addstring(&json, "outcome", 0 != event.hit ? "hit" : "miss", ZBX_JSON_TYPE_STRING);
+		zbx_json_close(&json);
+	}
+
+	SET_STR_RESULT(result, strdup(json.buffer));
+	zbx_json_free(&json);
+
+	return SYSINFO_RET_OK;
+}
+
+typedef struct
+{
+	zbx_deltacloud_service_t	*service;
+	md5_byte_t	digest[MD5_DIGEST_SIZE];
+	char	*url;
+	char	*key;
+	char	*secret;
+	char	*driver;
+	char	*provider;
+	int	refresh_instances;
+	zbx_vector_ptr_t	instance_ids;
+}
+zbx_cloud_job_t;
+
+/* Deltacloud connection kept by the collector between refreshes, keyed by the service digest */
+typedef struct
+{
+	md5_byte_t	digest[MD5_DIGEST_SIZE];
+	struct deltacloud_api	api;
+	int	lastuse;
+}
+zbx_cloud_api_t;
+
+/* collector private, the pollers never talk to Deltacloud */
+static zbx_hashset_t	cloud_apis;
+
+static zbx_hash_t	cloud_api_hash_func(const void *data)
+{
+	const zbx_cloud_api_t	*api = (const zbx_cloud_api_t *)data;
+
+	return ZBX_DEFAULT_HASH_ALGO(api->digest, MD5_DIGEST_SIZE, ZBX_DEFAULT_HASH_SEED);
+}
+
+static int	cloud_api_compare_func(const void *d1, const void *d2)
+{
+	const zbx_cloud_api_t	*a1 = (const zbx_cloud_api_t *)d1;
+	const zbx_cloud_api_t	*a2 = (const zbx_cloud_api_t *)d2;
+
+	return memcmp(a1->digest, a2->digest, MD5_DIGEST_SIZE);
+}
+
+/* metrics of one instance fetched by the collector, not yet stored in cloud_mem */
+typedef struct
+{
+	char	*instance_id;
+	struct deltacloud_metric	*metric;
+	int	rc;
+}
+zbx_cloud_metric_result_t;
+
+static void	cloud_job_free(zbx_cloud_job_t *job)
+{
+	zbx_free(job->url);
+	zbx_free(job->key);
+	zbx_free(job->secret);
+	zbx_free(job->driver);
+	zbx_free(job->provider);
+	zbx_vector_ptr_clean(&job->instance_ids, ZBX_DEFAULT_MEM_FREE_FUNC);
+	zbx_vector_ptr_destroy(&job->instance_ids);
+	zbx_free(job);
+}
+
+static zbx_cloud_job_t	*cloud_job_create(zbx_deltacloud_service_t *service)
+{
+	zbx_cloud_job_t	*job;
+
+	job = zbx_malloc(NULL, sizeof(zbx_cloud_job_t));
+	job->service = service;
+	memcpy(job->digest, service->digest, MD5_DIGEST_SIZE);
+	job->url = zbx_strdup(NULL, service->url);
+	job->key = zbx_strdup(NULL, service->key);
+	job->secret = cloud_secret_unmask(service->secret, service->secret_len);
+	job->driver = zbx_strdup(NULL, service->driver);
+	job->provider = zbx_strdup(NULL, service->provider);
+	job->refresh_instances = 0;
+	zbx_vector_ptr_create(&job->instance_ids);
+
+	return job;
+}
+
+/******************************************************************************
+ *                                                                            *
+ * Function: cloud_collector_endpoint_busy                                   *
+ *                                                                            *
+ * Purpose: check if ModuleEndpointCollectors collectors already work on      *
+ *          services behind the same Deltacloud URL                           *
+ *                                                                            *
+ ******************************************************************************/
+static int	cloud_collector_endpoint_busy(const zbx_deltacloud_service_t *service)
+{
+	int	collectors = 0;
+	zbx_hashset_iter_t	iter;
+	zbx_deltacloud_service_t	*other;
+
+	zbx_hashset_iter_reset(&deltacloud->services, &iter);
+	while (NULL != (other = zbx_hashset_iter_next(&iter)))
+	{
+		if (0 != other->refreshing && 0 == strcmp(other->url, service->url))
+			collectors += other->refreshing;
+	}
+
+	return (CONFIG_MODULE_ENDPOINT_COLLECTORS <= collectors ? SUCCEED : FAIL);
+}
+
+/******************************************************************************
+ *                                                                            *
+ * Function: cloud_nextcheck                                                  *
+ *                                                                            *
+ * Purpose: return the first time after now which is offset seconds past a    *
+ *          multiple of period                                                *
+ *                                                                            *
+ * Comment: CloudWatch aggregates datapoints over periods aligned to the      *
+ *          clock, so refreshing right after a period ends gets new values    *
+ *          as soon as they exist. The offset of each service differs, so     *
+ *          the services do not all hit Deltacloud at the same second.        *
+ *                                                                            *
+ ******************************************************************************/
+static int	cloud_nextcheck(int now, int period, int offset)
+{
+	int	nextcheck;
+
+	nextcheck = now - now % period + offset % period;
+
+	if (nextcheck <= now)
+		nextcheck += period;
+
+	return nextcheck;
+}
+
+/******************************************************************************
+ *                                                                            *
+ * Function: cloud_metric_info_update                                         *
+ *                                                                            *
+ * Purpose: store fetched metrics of an instance, changing only the values    *
+ *          which differ                                                      *
+ *                                                                            *
+ * Return value: SUCCEED - nothing changed                                    *
+ *               FAIL - at least one value differs                            *
+ *                                                                            *
+ ******************************************************************************/
+static int	cloud_metric_info_update(zbx_deltacloud_metric_info_t *metric_info, const struct deltacloud_metric *metric)
+{
+	int	ret = SUCCEED, metrics_num = 0, units_changed = 0;
+	zbx_deltacloud_metric_t		*deltacloud_metric;
+	zbx_deltacloud_metric_value_t	value;
+	const struct deltacloud_metric	*it;
+
+	for (it = metric; NULL != it; it = it->next)
+	{
+		if (NULL == it->name || NULL == (deltacloud_metric = cloud_index_get(&metric_info->metrics_index, it->name)))
+			break;
+
+		cloud_metric_value_parse(&value, it);
+
+		if (SUCCEED != cloud_metric_value_compare(&value, &deltacloud_metric->metric_value))
+		{
+			if (value.unit != deltacloud_metric->metric_value.unit)
+				units_changed = 1;
+
+			deltacloud_metric->metric_value = value;
+			ret = FAIL;
+		}
+
+		metrics_num++;
+	}
+
+	if (NULL == it && metrics_num == metric_info->metrics.values_num)
+	{
+		/* new values alone do not change the discovered metrics */
+		if (0 != units_changed || NULL == metric_info->lld)
+			cloud_metric_lld_update(metric_info);
+
+		return ret;
+	}
+
+	/* metrics were added or removed, the set is rebuilt */
+	zbx_hashset_clear(&metric_info->metrics_index);
+	zbx_vector_ptr_clean(&metric_info->metrics, (zbx_mem_free_func_t)cloud_metric_shared_free);
+
+	/* an instance without metrics is stored with an empty set so it is not fetched again at once */
+	for (; NULL != metric; metric = metric->next)
+	{
+		deltacloud_metric = cloud_metric_shared_dup(metric);
+		zbx_vector_ptr_append(&metric_info->metrics, deltacloud_metric);
+		cloud_index_add(&metric_info->metrics_index, deltacloud_metric->name, deltacloud_metric);
+	}
+
+	cloud_metric_lld_update(metric_info);
+
+	return FAIL;
+}
+
+/******************************************************************************
+ *                                                                            *
+ * Function: cloud_collector_get_job                                          *
+ *                                                                            *
+ * Purpose: claim the due instance list and up to ModuleMetricBatchSize due   *
+ *          metric sets of one service, copying the connection data into      *
+ *          private memory so no lock is held while talking to Deltacloud     *
+ *                                                                            *
+ * Comment: claimed metric sets are skipped by the other collectors until     *
+ *          cloud_collector_release_job() is called, so the batches of one    *
+ *          service are fetched by several collectors at once                 *
+ *                                                                            *
+ ******************************************************************************/
+static zbx_cloud_job_t	*cloud_collector_get_job(int now)
+{
+	zbx_hashset_iter_t	iter, metric_info_iter;
+	zbx_deltacloud_service_t	*service;
+	zbx_deltacloud_metric_info_t	*metric_info;
+	zbx_cloud_job_t	*job = NULL;
+
+	cloud_wrlock();
+
+	zbx_hashset_iter_reset(&deltacloud->services, &iter);
+	while (NULL == job && NULL != (service = zbx_hashset_iter_next(&iter)))
+	{
+		/* restored from the snapshot, no item has supplied the secret yet */
+		if (NULL == service->secret)
+			continue;
+
+		/* the Deltacloud server is already busy with other jobs */
+		if (SUCCEED == cloud_collector_endpoint_busy(service))
+		{
+			if (service->nextcheck <= now && 0 == service->throttled)
+			{
+				CLOUD_STATS_ADD(deltacloud->stats.api_throttled, 1);
+				service->throttled = 1;
+			}
+			continue;
+		}
+
+		if (service->nextcheck <= now)
+		{
+			job = cloud_job_create(service);
+			job->refresh_instances = 1;
+			service->throttled = 0;
+
+			/* claimed, cloud_collector_refresh_instances() sets the real nextcheck */
+			service->nextcheck = now + CONFIG_MODULE_INSTANCE_REFRESH;
+		}
+
+		/* instances of a service are due at the same aligned time and are fetched together, */
+		/* in batches so the collectors can share a large account                           */
+		zbx_hashset_iter_reset(&service->metric_infos, &metric_info_iter);
+		while (NULL != (metric_info = zbx_hashset_iter_next(&metric_info_iter)))
+		{
+			if (0 != metric_info->refreshing || metric_info->nextcheck > now)
+				continue;
+
+			/* do not ask for metrics of instances which are already gone */
+			if (0 != service->lastcheck && NULL == cloud_index_get(&service->instances_index,
+					metric_info->instance_id))
+			{
+				continue;
+			}
+
+			if (NULL == job)
+				job = cloud_job_create(service);
+
+			zbx_vector_ptr_append(&job->instance_ids, zbx_strdup(NULL, metric_info->instance_id));
+			metric_info->refreshing = 1;
+
+			if (CONFIG_MODULE_METRIC_BATCH_SIZE == job->instance_ids.values_num)
+				break;
+		}
+
+		if (NULL != job)
+			service->refreshing++;
+	}
+
+	cloud_wrunlock();
+
+	return job;
+}
+
+static void	cloud_collector_release_job(zbx_cloud_job_t *job)
+{
+	int	i;
+	zbx_deltacloud_metric_info_t	*metric_info;
+
+	cloud_wrlock();
+
+	job->service->refreshing--;
+
+	for (i = 0; i < job->instance_ids.values_num; i++)
+	{
+		if (NULL != (metric_info = cloud_metric_info_get(job->service, job->instance_ids.values[i])))
+			metric_info->refreshing = 0;
+	}
+
+	cloud_wrunlock();
+}
+
+/* state of an instance list refresh */
+typedef struct
+{
+	zbx_deltacloud_service_t	*service;
+	int	now;
+	int	changed;	/* instances were added or replaced, the LLD document is rendered again */
+}
+zbx_cloud_instance_ingest_t;
+
+/******************************************************************************
+ *                                                                            *
+ * Function: cloud_collector_ingest_instance                                  *
+ *                                                                            *
+ * Purpose: store one instance returned by Deltacloud in cloud_mem            *
+ *                                                                            *
+ * Comment: reconciles by id: known instances are updated in place, new ones  *
+ *          are added, instances not seen in this refresh are retired by      *
+ *          cloud_collector_retire_instances(). The caller holds the lock.    *
+ *          A record which has to be rebuilt takes the place of the old one   *
+ *          at once, the lock is released between the pages and the pollers  *
+ *          and the snapshot must never see an instance twice.                *
+ *                                                                            *
+ ******************************************************************************/
+static void	cloud_collector_ingest_instance(const struct deltacloud_instance *instance,
+		zbx_cloud_instance_ingest_t *ingest)
+{
+	zbx_deltacloud_service_t	*service = ingest->service;
+	zbx_deltacloud_instance_t	*deltacloud_instance, *replaced;
+	int				i;
+
+	if (NULL == (replaced = cloud_index_get(&service->instances_index, instance->id)) ||
+			SUCCEED != cloud_instance_shared_update(replaced, instance))
+	{
+		deltacloud_instance = cloud_instance_shared_dup(instance);
+
+		if (NULL != replaced)
+		{
+			/* a record whose own strings changed is rebuilt, this is rare enough for a linear search */
+			cloud_index_remove(&service->instances_index, instance->id);
+			i = zbx_vector_ptr_search(&service->instances, replaced, ZBX_DEFAULT_PTR_COMPARE_FUNC);
+			service->instances.values[i] = deltacloud_instance;
+			cloud_instance_shared_free(replaced);
+		}
+		else
+			zbx_vector_ptr_append(&service->instances, deltacloud_instance);
+
+		cloud_index_add(&service->instances_index, cloud_instance_str(deltacloud_instance,
+				CLOUD_INSTANCE_ID), deltacloud_instance);
+		ingest->changed = 1;
+	}
+	else
+		deltacloud_instance = replaced;
+
+	deltacloud_instance->lastseen = ingest->now;
+}
+
+/* instances the API no longer returns are removed, the caller holds the lock */
+static int	cloud_collector_retire_instances(zbx_deltacloud_service_t *service, int now)
+{
+	zbx_deltacloud_instance_t	*deltacloud_instance;
+	const char			*id;
+	int				i, retired = 0;
+
+	for (i = service->instances.values_num - 1; 0 <= i; i--)
+	{
+		deltacloud_instance = service->instances.values[i];
+
+		if (now == deltacloud_instance->lastseen)
+			continue;
+
+		id = cloud_instance_str(deltacloud_instance, CLOUD_INSTANCE_ID);
+		cloud_index_remove(&service->instances_index, id);
+
+		/* metrics of a terminated instance are not refreshed any more */
+		cloud_metric_info_remove(service, cloud_metric_info_get(service, id));
+
+		cloud_instance_shared_free(deltacloud_instance);
+		zbx_vector_ptr_remove(&service->instances, i);
+		retired++;
+	}
+
+	return retired;
+}
+
+/******************************************************************************
+ *                                                                            *
+ * Function: cloud_collector_refresh_instances                                *
+ *                                                                            *
+ * Purpose: fetch the instance list of a service and store it in cloud_mem    *
+ *                                                                            *
+ * Comment: libdeltacloud returns the whole fleet in one list before it is    *
+ *          stored, the list is stored in pages of INSTANCE_PAGE_SIZE         *
+ *          instances and the pollers are let in between the pages.           *
+ *                                                                            *
+ ******************************************************************************/
+static int	cloud_collector_refresh_instances(zbx_cloud_job_t *job, struct deltacloud_api *api)
+{
+	zbx_cloud_instance_ingest_t	ingest;
+	struct deltacloud_instance	*instances = NULL, *instance;
+	int				ret = SUCCEED, paged = 0;
+	double				start;
+
+	ingest.service = job->service;
+	ingest.now = time(NULL);
+	ingest.changed = 0;
+
+	start = zbx_time();
+
+	if (-1 == deltacloud_get_instances(api, &instances))
+	{
+		CLOUD_STATS_ADD(deltacloud->stats.api_errors, 1);
+		ret = FAIL;
+	}
+
+	/* the latency is that of the request alone, storing the list is not counted */
+	cloud_stats_api_latency(start);
+	CLOUD_STATS_ADD(deltacloud->stats.api_instance_requests, 1);
+
+	while (NULL != (instance = instances))
+	{
+		instances = instance->next;
+		instance->next = NULL;
+
+		if (0 == paged)
+			cloud_wrlock();
+
+		cloud_collector_ingest_instance(instance, &ingest);
+		deltacloud_free_instance_list(&instance);
+
+		if (INSTANCE_PAGE_SIZE == ++paged)
+		{
+			cloud_wrunlock();
+			paged = 0;
+		}
+	}
+
+	if (0 == paged)
+		cloud_wrlock();
+
+	if (SUCCEED == ret)
+	{
+		if (0 != cloud_collector_retire_instances(job->service, ingest.now))
+			ingest.changed = 1;
+
+		if (0 != ingest.changed || NULL == job->service->lld)
+			cloud_instance_lld_update(job->service);
+
+		job->service->lastcheck = ingest.now;
+		job->service->nextcheck = cloud_nextcheck(ingest.now, CONFIG_MODULE_INSTANCE_REFRESH,
+				job->service->jitter);
+	}
+	else
+	{
+		/* the list may be incomplete, nothing is retired until a refresh succeeds */
+		job->service->nextcheck = time(NULL) + RETRY_TIME;
+	}
+
+	cloud_wrunlock();
+
+	return ret;
+}
+
+/******************************************************************************
+ *                                                                            *
+ * Function: cloud_collector_update_metrics                                   *
+ *                                                                            *
+ * Purpose: store a page of fetched metric sets in cloud_mem under one lock   *
+ *                                                                            *
+ ******************************************************************************/
+static void	cloud_collector_update_metrics(zbx_deltacloud_service_t *service, zbx_vector_ptr_t *results, int now)
+{
+	int	i;
+	zbx_deltacloud_metric_info_t	*metric_info;
+	zbx_cloud_metric_result_t	*result;
+
+	cloud_wrlock();
+
+	for (i = 0; i < results->values_num; i++)
+	{
+		result = results->values[i];
+
+		if (NULL == (metric_info = cloud_metric_info_get(service, result->instance_id)))
+			continue;
+
+		if (SUCCEED != result->rc)
+		{
+			metric_info->nextcheck = now + RETRY_TIME;
+			continue;
+		}
+
+		if (SUCCEED == cloud_metric_info_update(metric_info, result->metric))
+		{
+			/* no new datapoint, back off on instances which are stopped or idle */
+			if (CONFIG_MODULE_METRIC_REFRESH << (metric_info->quiet + 1) <= METRIC_QUIET_MAX)
+				metric_info->quiet++;
+		}
+		else
+			metric_info->quiet = 0;
+
+		metric_info->lastcheck = now;
+		metric_info->nextcheck = cloud_nextcheck(now, CONFIG_MODULE_METRIC_REFRESH << metric_info->quiet,
+				METRIC_DELAY + service->jitter);
+	}
+
+	cloud_wrunlock();
+}
+
+static void	cloud_metric_result_free(zbx_cloud_metric_result_t *result)
+{
+	if (NULL != result->metric)
+		deltacloud_free_metric_list(&result->metric);
+	zbx_free(result);
+}
+
+static void	cloud_collector_set_nextcheck(zbx_cloud_job_t *job, int nextcheck)
+{
+	int	i;
+	zbx_deltacloud_metric_info_t	*metric_info;
+
+	cloud_wrlock();
+
+	if (0 != job->refresh_instances)
+		job->service->nextcheck = nextcheck;
+
+	for (i = 0; i < job->instance_ids.values_num; i++)
+	{
+		if (NULL != (metric_info = cloud_metric_info_get(job->service, job->instance_ids.values[i])))
+			metric_info->nextcheck = nextcheck;
+	}
+
+	cloud_wrunlock();
+}
+
+/******************************************************************************
+ *                                                                            *
+ * Function: cloud_collector_get_api                                          *
+ *                                                                            *
+ * Purpose: return the Deltacloud connection of a service, initializing it    *
+ *          only on the first refresh or after a failure                      *
+ *                                                                            *
+ * Comment: deltacloud_initialize() fetches the API entry point, keeping the  *
+ *          handle saves that request on every refresh                        *
+ *                                                                            *
+ ******************************************************************************/
+static struct deltacloud_api	*cloud_collector_get_api(zbx_cloud_job_t *job, int now)
+{
+	zbx_cloud_api_t	api_local, *api;
+	double		start;
+	int		ret;
+
+	memcpy(api_local.digest, job->digest, MD5_DIGEST_SIZE);
+
+	if (NULL == (api = zbx_hashset_search(&cloud_apis, &api_local)))
+	{
+		memset(&api_local.api, 0, sizeof(api_local.api));
+		api_local.lastuse = 0;
+
+		start = zbx_time();
+		ret = deltacloud_initialize(&api_local.api, job->url, job->key, job->secret, job->driver,
+				job->provider);
+		cloud_stats_api_latency(start);
+		CLOUD_STATS_ADD(deltacloud->stats.api_connects, 1);
+
+		if (-1 == ret)
+		{
+			CLOUD_STATS_ADD(deltacloud->stats.api_errors, 1);
+			return NULL;
+		}
+
+		api = zbx_hashset_insert(&cloud_apis, &api_local, sizeof(api_local));
+	}
+
+	api->lastuse = now;
+
+	return &api->api;
+}
+
+/******************************************************************************
+ *                                                                            *
+ * Function: cloud_collector_drop_api                                         *
+ *                                                                            *
+ * Purpose: forget the connection of a service after a failed request, so the *
+ *          next refresh starts again from the API entry point                *
+ *                                                                            *
+ ******************************************************************************/
+static void	cloud_collector_drop_api(const md5_byte_t *digest)
+{
+	zbx_cloud_api_t	api_local, *api;
+
+	memcpy(api_local.digest, digest, MD5_DIGEST_SIZE);
+
+	if (NULL == (api = zbx_hashset_search(&cloud_apis, &api_local)))
+		return;
+
+	deltacloud_free(&api->api);
+	zbx_hashset_remove(&cloud_apis, &api_local);
+}
+
+/******************************************************************************
+ *                                                                            *
+ * Function: cloud_collector_refresh                                          *
+ *                                                                            *
+ * Purpose: fetch instances and metrics of one service from Deltacloud and    *
+ *          store them in cloud_mem                                           *
+ *                                                                            *
+ * Comment: Deltacloud has no request returning the metrics of several        *
+ *          instances, so the metrics of all instances of the service are     *
+ *          fetched in one pass over one API handle and stored in pages of    *
+ *          ModuleMetricBatchSize instances per lock                          *
+ *                                                                            *
+ ******************************************************************************/
+static void	cloud_collector_refresh(zbx_cloud_job_t *job)
+{
+	int	i, failed = 0;
+	struct deltacloud_api	*api;
+	double	start, refresh_start;
+	zbx_cloud_metric_result_t	*result;
+	zbx_vector_ptr_t	results;
+
+	zbx_setproctitle("cloud module collector [refreshing %s %s]", job->driver, job->provider);
+
+	refresh_start = zbx_time();
+
+	if (NULL == (api = cloud_collector_get_api(job, time(NULL))))
+	{
+		zabbix_log(LOG_LEVEL_WARNING, "cannot connect to Deltacloud at \"%s\"", job->url);
+		cloud_collector_set_nextcheck(job, time(NULL) + RETRY_TIME);
+		goto out;
+	}
+
+	if (0 != job->refresh_instances && SUCCEED != cloud_collector_refresh_instances(job, api))
+	{
+		zabbix_log(LOG_LEVEL_WARNING, "cannot get instances from Deltacloud at \"%s\"", job->url);
+		failed = 1;
+	}
+
+	zbx_vector_ptr_create(&results);
+	zbx_vector_ptr_reserve(&results, CONFIG_MODULE_METRIC_BATCH_SIZE);
+
+	for (i = 0; i < job->instance_ids.values_num; i++)
+	{
+		result = zbx_malloc(NULL, sizeof(zbx_cloud_metric_result_t));
+		result->instance_id = job->instance_ids.values[i];
+		result->metric = NULL;
+
+		start = zbx_time();
+		result->rc = (-1 == deltacloud_get_metrics_by_instance_id(api, result->instance_id, &result->metric) ?
+				FAIL : SUCCEED);
+		cloud_stats_api_latency(start);
+		CLOUD_STATS_ADD(deltacloud->stats.api_metric_requests, 1);
+
+		if (SUCCEED != result->rc)
+		{
+			CLOUD_STATS_ADD(deltacloud->stats.api_errors, 1);
+			failed = 1;
+			zabbix_log(LOG_LEVEL_WARNING, "cannot get metrics of instance \"%s\" from Deltacloud at \"%s\"",
+					result->instance_id, job->url);
+		}
+
+		zbx_vector_ptr_append(&results, result);
+
+		if (CONFIG_MODULE_METRIC_BATCH_SIZE == results.values_num || i == job->instance_ids.values_num - 1)
+		{
+			cloud_collector_update_metrics(job->service, &results, time(NULL));
+			zbx_vector_ptr_clean(&results, (zbx_mem_free_func_t)cloud_metric_result_free);
+		}
+	}
+
+	zbx_vector_ptr_destroy(&results);
+
+	if (0 != failed)
+		cloud_collector_drop_api(job->digest);
+out:
+	CLOUD_STATS_ADD(deltacloud->stats.refreshes, 1);
+	cloud_stats_observe(deltacloud->stats.refresh_duration, &deltacloud->stats.refresh_duration_ms,
+			cloud_stats_duration_bounds, zbx_time() - refresh_start);
+}
+
+/******************************************************************************
+ *                                                                            *
+ * Function: cloud_collector_housekeeping                                     *
+ *                                                                            *
+ * Purpose: remove services and metric sets no item asked for in              *
+ *          ModuleCacheExpire seconds                                         *
+ *                                                                            *
+ * Comment: services of rotated credentials and instances that are not        *
+ *          monitored any more would otherwise stay in cloud_mem and be       *
+ *          scanned by the collector forever                                  *
+ *                                                                            *
+ ******************************************************************************/
+static void	cloud_collector_housekeeping(int now)
+{
+	int	services = 0, metric_infos = 0;
+	zbx_hashset_iter_t	iter, metric_info_iter;
+	zbx_deltacloud_service_t	*service;
+	zbx_deltacloud_metric_info_t	*metric_info;
+	zbx_cloud_api_t	*api;
+
+	cloud_wrlock();
+
+	zbx_hashset_iter_reset(&deltacloud->services, &iter);
+	while (NULL != (service = zbx_hashset_iter_next(&iter)))
+	{
+		/* a collector still holds a pointer to the service it refreshes */
+		if (0 != service->refreshing)
+			continue;
+
+		if (service->lastaccess + CONFIG_MODULE_CACHE_EXPIRE < now)
+		{
+			cloud_service_shared_clean(service);
+			zbx_hashset_iter_remove(&iter);
+			services++;
+			continue;
+		}
+
+		zbx_hashset_iter_reset(&service->metric_infos, &metric_info_iter);
+		while (NULL != (metric_info = zbx_hashset_iter_next(&metric_info_iter)))
+		{
+			if (metric_info->lastaccess + CONFIG_MODULE_CACHE_EXPIRE >= now)
+				continue;
+
+			cloud_metric_info_shared_clean(metric_info);
+			zbx_hashset_iter_remove(&metric_info_iter);
+			metric_infos++;
+		}
+	}
+
+	cloud_wrunlock();
+
+	/* connections of services nobody refreshes any more */
+	zbx_hashset_iter_reset(&cloud_apis, &iter);
+	while (NULL != (api = zbx_hashset_iter_next(&iter)))
+	{
+		if (api->lastuse + CONFIG_MODULE_CACHE_EXPIRE >= now)
+			continue;
+
+		deltacloud_free(&api->api);
+		zbx_hashset_iter_remove(&iter);
+	}
+
+	if (0 != services || 0 != metric_infos)
+	{
+		zabbix_log(LOG_LEVEL_DEBUG, "cloud module housekeeping removed %d services and %d metric sets",
+				services, metric_infos);
+	}
+}
+
+/* the snapshot buffer, or the mapped snapshot file while loading */
+typedef struct
+{
+	char	*data;
+	size_t	size;
+	size_t	offset;
+}
+zbx_cloud_snapshot_t;
+
+static void	cloud_snapshot_add(zbx_cloud_snapshot_t *snapshot, const void *src, size_t len)
+{
+	while (snapshot->offset + len > snapshot->size)
+	{
+		snapshot->size = (0 == snapshot->size ? 64 * ZBX_KIBIBYTE : snapshot->size * 2);
+		snapshot->data = zbx_realloc(snapshot->data, snapshot->size);
+	}
+
+	memcpy(snapshot->data + snapshot->offset, src, len);
+	snapshot->offset += len;
+}
+
+static void	cloud_snapshot_add_int(zbx_cloud_snapshot_t *snapshot, int value)
+{
+	cloud_snapshot_add(snapshot, &value, sizeof(value));
+}
+
+/* strings are stored with their terminating zero, length 0 stands for NULL */
+static void	cloud_snapshot_add_str(zbx_cloud_snapshot_t *snapshot, const char *str)
+{
+	zbx_uint32_t	len = (NULL != str ? strlen(str) + 1 : 0);
+
+	cloud_snapshot_add(snapshot, &len, sizeof(len));
+	cloud_snapshot_add(snapshot, str, len);
+}
+
+static int	cloud_snapshot_get(zbx_cloud_snapshot_t *snapshot, void *dst, size_t len)
+{
+	if (snapshot->offset + len > snapshot->size)
+		return FAIL;
+
+	memcpy(dst, snapshot->data + snapshot->offset, len);
+	snapshot->offset += len;
+
+	return SUCCEED;
+}
+
+static int	cloud_snapshot_get_int(zbx_cloud_snapshot_t *snapshot, int *value)
+{
+	return cloud_snapshot_get(snapshot, value, sizeof(int));
+}
+
+/* the string is not copied, it points into the mapped file */
+static int	cloud_snapshot_get_str(zbx_cloud_snapshot_t *snapshot, char **str)
+{
+	zbx_uint32_t	len;
+
+	if (SUCCEED != cloud_snapshot_get(snapshot, &len, sizeof(len)) || snapshot->offset + len > snapshot->size)
+		return FAIL;
+
+	if (0 == len)
+	{
+		*str = NULL;
+		return SUCCEED;
+	}
+
+	if ('\0' != snapshot->data[snapshot->offset + len - 1])
+		return FAIL;
+
+	*str = snapshot->data + snapshot->offset;
+	snapshot->offset += len;
+
+	return SUCCEED;
+}
+
+static void	cloud_snapshot_add_addresses(zbx_cloud_snapshot_t *snapshot, const zbx_deltacloud_instance_t *instance,
+		int field)
+{
+	const char	*address = cloud_instance_str(instance, field);
+	int		i, num = cloud_instance_addresses_num(instance, field);
+
+	cloud_snapshot_add_int(snapshot, num);
+
+	for (i = 0; i < num; i++, address += strlen(address) + 1)
+		cloud_snapshot_add_str(snapshot, address);
+}
+
+/* the addresses are read into one array of list nodes, freed with zbx_free() */
+static int	cloud_snapshot_get_addresses(zbx_cloud_snapshot_t *snapshot, struct deltacloud_address **addresses)
+{
+	int	i, num;
+
+	*addresses = NULL;
+
+	if (SUCCEED != cloud_snapshot_get_int(snapshot, &num) || 0 > num ||
+			(size_t)num > snapshot->size - snapshot->offset)
+	{
+		return FAIL;
+	}
+
+	if (0 == num)
+		return SUCCEED;
+
+	*addresses = zbx_calloc(NULL, num, sizeof(struct deltacloud_address));
+
+	for (i = 0; i < num; i++)
+	{
+		if (0 != i)
+			(*addresses)[i - 1].next = &(*addresses)[i];
+
+		if (SUCCEED != cloud_snapshot_get_str(snapshot, &(*addresses)[i].address) ||
+				NULL == (*addresses)[i].address)
+		{
+			return FAIL;
+		}
+	}
+
+	return SUCCEED;
+}
+
+static void	cloud_snapshot_add_instance(zbx_cloud_snapshot_t *snapshot, const zbx_deltacloud_instance_t *instance)
+{
+	cloud_snapshot_add_str(snapshot, cloud_instance_str(instance, CLOUD_INSTANCE_HREF));
+	cloud_snapshot_add_str(snapshot, cloud_instance_str(instance, CLOUD_INSTANCE_ID));
+	cloud_snapshot_add_str(snapshot, cloud_instance_str(instance, CLOUD_INSTANCE_NAME));
+	cloud_snapshot_add_str(snapshot, instance->owner_id);
+	cloud_snapshot_add_str(snapshot, instance->image_id);
+	cloud_snapshot_add_str(snapshot, instance->image_href);
+	cloud_snapshot_add_str(snapshot, instance->realm_id);
+	cloud_snapshot_add_str(snapshot, instance->realm_href);
+	cloud_snapshot_add_str(snapshot, instance->state);
+	cloud_snapshot_add_str(snapshot, cloud_instance_str(instance, CLOUD_INSTANCE_LAUNCH_TIME));
+	cloud_snapshot_add_str(snapshot, instance->hwp.href);
+	cloud_snapshot_add_str(snapshot, instance->hwp.id);
+	cloud_snapshot_add_str(snapshot, instance->hwp.name);
+	cloud_snapshot_add_addresses(snapshot, instance, CLOUD_INSTANCE_PUBLIC_ADDR);
+	cloud_snapshot_add_addresses(snapshot, instance, CLOUD_INSTANCE_PRIVATE_ADDR);
+}
+
+static void	cloud_snapshot_add_metric_info(zbx_cloud_snapshot_t *snapshot, const zbx_deltacloud_metric_info_t *metric_info)
+{
+	int	i;
+	const zbx_deltacloud_metric_t	*metric;
+
+	cloud_snapshot_add_str(snapshot, metric_info->instance_id);
+	cloud_snapshot_add_int(snapshot, metric_info->lastcheck);
+	cloud_snapshot_add_int(snapshot, metric_info->lastaccess);
+	cloud_snapshot_add_int(snapshot, metric_info->metrics.values_num);
+
+	for (i = 0; i < metric_info->metrics.values_num; i++)
+	{
+		metric = metric_info->metrics.values[i];
+
+		cloud_snapshot_add_str(snapshot, metric->name);
+		cloud_snapshot_add_str(snapshot, -1 != metric->metric_value.unit ?
+				deltacloud->units.values[metric->metric_value.unit] : NULL);
+		cloud_snapshot_add(snapshot, &metric->metric_value.flags, sizeof(metric->metric_value.flags));
+		cloud_snapshot_add(snapshot, &metric->metric_value.minimum, sizeof(double));
+		cloud_snapshot_add(snapshot, &metric->metric_value.maximum, sizeof(double));
+		cloud_snapshot_add(snapshot, &metric->metric_value.samples, sizeof(double));
+		cloud_snapshot_add(snapshot, &metric->metric_value.average, sizeof(double));
+	}
+}
+
+/******************************************************************************
+ *                                                                            *
+ * Function: cloud_snapshot_write                                             *
+ *                                                                            *
+ * Purpose: save the cloud cache to ModuleSnapshotFile                        *
+ *                                                                            *
+ * Comment: the cache is copied into a private buffer under the read lock and *
+ *          written to a temporary file outside of it, which replaces the     *
+ *          snapshot only when complete. Secrets are not saved, they are      *
+ *          masked with a pad that does not survive the restart anyway.       *
+ *          Values are stored in the native byte order, the snapshot is only  *
+ *          read back by the same module on the same host.                    *
+ *                                                                            *
+ ******************************************************************************/
+static void	cloud_snapshot_write(void)
+{
+	zbx_cloud_snapshot_t	snapshot = {NULL, 0, 0};
+	zbx_hashset_iter_t	iter, metric_info_iter;
+	zbx_deltacloud_service_t	*service;
+	zbx_deltacloud_metric_info_t	*metric_info;
+	char	*tmp_file;
+	int	i, fd, services_num;
+
+	if (NULL == CONFIG_MODULE_SNAPSHOT_FILE)
+		return;
+
+	cloud_snapshot_add(&snapshot, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC) - 1);
+	cloud_snapshot_add_int(&snapshot, SNAPSHOT_VERSION);
+
+	cloud_rdlock();
+
+	services_num = deltacloud->services.num_data;
+	cloud_snapshot_add_int(&snapshot, services_num);
+
+	zbx_hashset_iter_reset(&deltacloud->services, &iter);
+	while (NULL != (service = zbx_hashset_iter_next(&iter)))
+	{
+		cloud_snapshot_add(&snapshot, service->digest, MD5_DIGEST_SIZE);
+		cloud_snapshot_add_str(&snapshot, service->url);
+		cloud_snapshot_add_str(&snapshot, service->key);
+		cloud_snapshot_add_str(&snapshot, service->driver);
+		cloud_snapshot_add_str(&snapshot, service->provider);
+		cloud_snapshot_add_int(&snapshot, service->lastcheck);
+		cloud_snapshot_add_int(&snapshot, service->lastaccess);
+
+		cloud_snapshot_add_int(&snapshot, service->instances.values_num);
+		for (i = 0; i < service->instances.values_num; i++)
+			cloud_snapshot_add_instance(&snapshot, service->instances.values[i]);
+
+		cloud_snapshot_add_int(&snapshot, service->metric_infos.num_data);
+		zbx_hashset_iter_reset(&service->metric_infos, &metric_info_iter);
+		while (NULL != (metric_info = zbx_hashset_iter_next(&metric_info_iter)))
+			cloud_snapshot_add_metric_info(&snapshot, metric_info);
+	}
+
+	cloud_rdunlock();
+
+	tmp_file = zbx_dsprintf(NULL, "%s.tmp", CONFIG_MODULE_SNAPSHOT_FILE);
+
+	if (-1 == (fd = open(tmp_file, O_WRONLY | O_CREAT | O_TRUNC, 0600)))
+	{
+		zabbix_log(LOG_LEVEL_WARNING, "cannot create cloud cache snapshot \"%s\": %s", tmp_file,
+				zbx_strerror(errno));
+		goto out;
+	}
+
+	if ((ssize_t)snapshot.offset != write(fd, snapshot.data, snapshot.offset))
+	{
+		zabbix_log(LOG_LEVEL_WARNING, "cannot write cloud cache snapshot \"%s\": %s", tmp_file,
+				zbx_strerror(errno));
+		close(fd);
+		unlink(tmp_file);
+		goto out;
+	}
+
+	close(fd);
+
+	if (0 != rename(tmp_file, CONFIG_MODULE_SNAPSHOT_FILE))
+	{
+		zabbix_log(LOG_LEVEL_WARNING, "cannot replace cloud cache snapshot \"%s\": %s",
+				CONFIG_MODULE_SNAPSHOT_FILE, zbx_strerror(errno));
+		unlink(tmp_file);
+		goto out;
+	}
+
+	zabbix_log(LOG_LEVEL_DEBUG, "saved %d services to cloud cache snapshot \"%s\"", services_num,
+			CONFIG_MODULE_SNAPSHOT_FILE);
+out:
+	zbx_free(tmp_file);
+	zbx_free(snapshot.data);
+}
+
+static int	cloud_snapshot_load_instance(zbx_cloud_snapshot_t *snapshot, zbx_deltacloud_service_t *service, int now)
+{
+	struct deltacloud_instance	instance;
+	zbx_deltacloud_instance_t	*deltacloud_instance;
+	int				ret = FAIL;
+
+	memset(&instance, 0, sizeof(instance));
+
+	if (SUCCEED != cloud_snapshot_get_str(snapshot, &instance.href) ||
+			SUCCEED != cloud_snapshot_get_str(snapshot, &instance.id) ||
+			SUCCEED != cloud_snapshot_get_str(snapshot, &instance.name) ||
+			SUCCEED != cloud_snapshot_get_str(snapshot, &instance.owner_id) ||
+			SUCCEED != cloud_snapshot_get_str(snapshot, &instance.image_id) ||
+			SUCCEED != cloud_snapshot_get_str(snapshot, &instance.image_href) ||
+			SUCCEED != cloud_snapshot_get_str(snapshot, &instance.realm_id) ||
+			SUCCEED != cloud_snapshot_get_str(snapshot, &instance.realm_href) ||
+			SUCCEED != cloud_snapshot_get_str(snapshot, &instance.state) ||
+			SUCCEED != cloud_snapshot_get_str(snapshot, &instance.launch_time) ||
+			SUCCEED != cloud_snapshot_get_str(snapshot, &instance.hwp.href) ||
+			SUCCEED != cloud_snapshot_get_str(snapshot, &instance.hwp.id) ||
+			SUCCEED != cloud_snapshot_get_str(snapshot, &instance.hwp.name) ||
+			SUCCEED != cloud_snapshot_get_addresses(snapshot, &instance.public_addresses) ||
+			SUCCEED != cloud_snapshot_get_addresses(snapshot, &instance.private_addresses))
 	{
-		service = deltacloud->services.values[i];
-		if (NULL != service && 0 == strcmp(service->url, url) && 0 == strcmp(service->key, key) && 0 == strcmp(service->secret, secret) && 0 == strcmp(service->driver, driver) && 0 == strcmp(service->provider, provider))
-		{
-			return service;
-		}
+		goto out;
 	}
 
-	service = __cloud_mem_malloc_func(NULL, sizeof(zbx_deltacloud_service_t));
+	if (NULL == instance.id || NULL != cloud_index_get(&service->instances_index, instance.id))
+		goto out;
 
-	memset(service, 0, sizeof(zbx_deltacloud_service_t));
+	deltacloud_instance = cloud_instance_shared_dup(&instance);
+	deltacloud_instance->lastseen = now;
+	zbx_vector_ptr_append(&service->instances, deltacloud_instance);
+	cloud_index_add(&service->instances_index, cloud_instance_str(deltacloud_instance, CLOUD_INSTANCE_ID),
+			deltacloud_instance);
 
-	service->url = cloud_shared_strdup(url);
-	service->key = cloud_shared_strdup(key);
-	service->secret = cloud_shared_strdup(secret);
-	service->driver = cloud_shared_strdup(driver);
-	service->provider = cloud_shared_strdup(provider);
-	service->lastaccess = time(NULL);
-	service->lastcheck = time(NULL);
-	CLOUD_VECTOR_CREATE(&service->instances, ptr);
-	CLOUD_VECTOR_CREATE(&service->metric_infos, ptr);
+	ret = SUCCEED;
+out:
+	zbx_free(instance.public_addresses);
+	zbx_free(instance.private_addresses);
 
-	zbx_vector_ptr_append(&deltacloud->services, service);
-	return service;
+	return ret;
 }
 
-int	zbx_module_cloud_instance_discovery(AGENT_REQUEST *request, AGENT_RESULT *result)
+static int	cloud_snapshot_load_metric_info(zbx_cloud_snapshot_t *snapshot, zbx_deltacloud_service_t *service, int now)
 {
-	zabbix_log(LOG_LEVEL_ERR, "Start cloud.instance.discovery: [cloud_mem used_size: %d]\n", cloud_mem->used_size);
-	zbx_module_item_timeout(CONFIG_MODULE_TIMEOUT);
-	int i;
-	struct zbx_json json;
-	char	*url;
-	char	*key;
-	char	*secret;
-	char	*driver;
-	char	*provider;
-	zbx_deltacloud_service_t	*service = NULL;
-	zbx_deltacloud_instance_t	*deltacloud_instance = NULL;
-	zbx_deltacloud_address_t	*public_address = NULL;
-	zbx_deltacloud_address_t	*private_address = NULL;
-	struct deltacloud_api api;
-	struct deltacloud_instance *instance = NULL;
-	struct deltacloud_instance *start_ptr = NULL;
-
-	if (request->nparam != 5)
+	int	i, metrics_num;
+	char	*name, *unit;
+	zbx_deltacloud_metric_info_t	metric_info_local, *metric_info;
+	zbx_deltacloud_metric_value_t	value;
+	zbx_deltacloud_metric_t	*metric;
+
+	memset(&metric_info_local, 0, sizeof(metric_info_local));
+
+	if (SUCCEED != cloud_snapshot_get_str(snapshot, &metric_info_local.instance_id) ||
+			SUCCEED != cloud_snapshot_get_int(snapshot, &metric_info_local.lastcheck) ||
+			SUCCEED != cloud_snapshot_get_int(snapshot, &metric_info_local.lastaccess) ||
+			SUCCEED != cloud_snapshot_get_int(snapshot, &metrics_num))
 	{
-		/* set optional error message */
-		SET_MSG_RESULT(result, strdup("Invalid number of parameters e.g.) cloud.instance.discovery[url, key, secret, driver, provider]"));
-		return SYSINFO_RET_FAIL;
+		return FAIL;
 	}
-	url = get_rparam(request, 0);
-	key = get_rparam(request, 1);
-	secret = get_rparam(request, 2);
-	driver = get_rparam(request, 3);
-	provider = get_rparam(request, 4);
 
-	// json format init
-	zbx_json_init(&json, ZBX_JSON_STAT_BUF_LEN);
-	// Add "data":[] for LLD format
-	zbx_json_addarray(&json, ZBX_PROTO_TAG_DATA);
-	service = zbx_deltacloud_get_service(url, key, secret, driver, provider);
-	
-	deltacloud_initialize(&api, url, key, secret, driver, provider);
+	if (NULL == metric_info_local.instance_id || NULL != cloud_metric_info_get(service,
+			metric_info_local.instance_id))
+	{
+		return FAIL;
+	}
 
-	deltacloud_get_instances(&api, &instance);
+	metric_info_local.instance_id = cloud_shared_strdup(metric_info_local.instance_id);
+	metric_info_local.nextcheck = cloud_nextcheck(now, CONFIG_MODULE_METRIC_REFRESH, METRIC_DELAY + service->jitter);
+	metric_info = zbx_hashset_insert(&service->metric_infos, &metric_info_local, sizeof(metric_info_local));
+	CLOUD_VECTOR_CREATE(&metric_info->metrics, ptr);
+	CLOUD_INDEX_CREATE(&metric_info->metrics_index);
 
-	zbx_vector_ptr_clean(&service->instances, (zbx_mem_free_func_t)cloud_instance_shared_free);
-	if(instance==NULL){
-		zbx_json_close(&json);
-		//SET_UI64_RESULT(result, 0);
-		SET_STR_RESULT(result, strdup(json.buffer));
-		zbx_json_free(&json);
-		return SYSINFO_RET_OK;
-	}
-	start_ptr = instance;
-	
-	while(1){
-		deltacloud_instance = __cloud_mem_malloc_func(NULL, sizeof(zbx_deltacloud_instance_t));
-		if(NULL != instance->href)
-			deltacloud_instance->href = cloud_shared_strdup(instance->href);
-		if(NULL != instance->id)
-			deltacloud_instance->id = cloud_shared_strdup(instance->id);
-		if(NULL != instance->name)
-			deltacloud_instance->name = cloud_shared_strdup(instance->name);
-		if(NULL != instance->owner_id)
-			deltacloud_instance->owner_id = cloud_shared_strdup(instance->owner_id);
-		if(NULL != instance->image_id)
-			deltacloud_instance->image_id = cloud_shared_strdup(instance->image_id);
-		if(NULL != instance->image_href)
-			deltacloud_instance->image_href = cloud_shared_strdup(instance->image_href);
-		if(NULL != instance->realm_id)
-			deltacloud_instance->realm_id = cloud_shared_strdup(instance->realm_id);
-		if(NULL != instance->realm_href)
-			deltacloud_instance->realm_href = cloud_shared_strdup(instance->realm_href);
-		if(NULL != instance->state)
-			deltacloud_instance->state = cloud_shared_strdup(instance->state);
-		if(NULL != instance->launch_time)
-			deltacloud_instance->launch_time = cloud_shared_strdup(instance->launch_time);
-
-		/* Add IP address information */
-		CLOUD_VECTOR_CREATE(&deltacloud_instance->public_addresses, ptr);
-		CLOUD_VECTOR_CREATE(&deltacloud_instance->private_addresses, ptr);
-		public_address = __cloud_mem_malloc_func(NULL, sizeof(zbx_deltacloud_address_t));
-		private_address = __cloud_mem_malloc_func(NULL, sizeof(zbx_deltacloud_address_t));
-
-		if(instance->public_addresses)
-			public_address->address = cloud_shared_strdup(instance->public_addresses->address);
-		if(instance->private_addresses)
-			private_address->address = cloud_shared_strdup(instance->private_addresses->address);
-
-		
-		zbx_vector_ptr_append(&deltacloud_instance->public_addresses, public_address);
-		zbx_vector_ptr_append(&deltacloud_instance->private_addresses, private_address);
-
-		deltacloud_instance->hwp = cloud_hardware_profile_shared_dup(&instance->hwp);
-		zbx_vector_ptr_append(&service->instances, deltacloud_instance);
-
-		/* Set json data for LLD response */
-		
-		zbx_json_addobject(&json, NULL);
-		if (NULL != instance->name)
-			zbx_json_addstring(&json, NAME_MACRO, deltacloud_instance->name, ZBX_JSON_TYPE_STRING);
-		if (NULL != instance->id)
-			zbx_json_addstring(&json, ID_MACRO, deltacloud_instance->id, ZBX_JSON_TYPE_STRING);
-		for (i = 0; i < deltacloud_instance->public_addresses.values_num; i++)
-		{
-			zbx_deltacloud_address_t *address = deltacloud_instance->public_addresses.values[i];
-			if(NULL != address)
-			{
-				zbx_json_addstring(&json, PUBLIC_ADDR_MACRO, address->address, ZBX_JSON_TYPE_STRING);
-			}
-			break; /* ToDo: multi address support */
-		}
-		
-		for (i = 0; i < deltacloud_instance->private_addresses.values_num; i++)
+	for (i = 0; i < metrics_num; i++)
+	{
+		memset(&value, 0, sizeof(value));
+
+		if (SUCCEED != cloud_snapshot_get_str(snapshot, &name) ||
+				SUCCEED != cloud_snapshot_get_str(snapshot, &unit) ||
+				SUCCEED != cloud_snapshot_get(snapshot, &value.flags, sizeof(value.flags)) ||
+				SUCCEED != cloud_snapshot_get(snapshot, &value.minimum, sizeof(double)) ||
+				SUCCEED != cloud_snapshot_get(snapshot, &value.maximum, sizeof(double)) ||
+				SUCCEED != cloud_snapshot_get(snapshot, &value.samples, sizeof(double)) ||
+				SUCCEED != cloud_snapshot_get(snapshot, &value.average, sizeof(double)))
 		{
-			zbx_deltacloud_address_t *address = deltacloud_instance->private_addresses.values[i];
-			zbx_json_addstring(&json, PRIVATE_ADDR_MACRO, address->address, ZBX_JSON_TYPE_STRING);
-			break; /* ToDo: multi address support */
+			return FAIL;
 		}
-		zbx_json_close(&json);
 
-		instance = instance->next;
-		if(instance == NULL){
-			break;
-		}
+		if (NULL == name || NULL != cloud_index_get(&metric_info->metrics_index, name))
+			return FAIL;
+
+		value.unit = cloud_unit_get_id(unit);
+
+		metric = __cloud_mem_malloc_func(NULL, sizeof(zbx_deltacloud_metric_t));
+		metric->name = cloud_strpool_intern(name);
+		metric->metric_value = value;
+		zbx_vector_ptr_append(&metric_info->metrics, metric);
+		cloud_index_add(&metric_info->metrics_index, metric->name, metric);
 	}
 
-	SET_STR_RESULT(result, strdup(json.buffer));
-	zbx_json_free(&json);
+	if (0 != metric_info->lastcheck)
+		cloud_metric_lld_update(metric_info);
 
-  	deltacloud_free_instance_list(&start_ptr);
-	zabbix_log(LOG_LEVEL_ERR, "Finish cloud.instance.discovery: [cloud_mem used_size: %d]\n", cloud_mem->used_size);
-	
-	return SYSINFO_RET_OK;
+	return SUCCEED;
 }
 
-int	zbx_module_cloud_instance_info(AGENT_REQUEST *request, AGENT_RESULT *result)
+static int	cloud_snapshot_load_service(zbx_cloud_snapshot_t *snapshot, int now)
 {
-	zabbix_log(LOG_LEVEL_ERR, "Start cloud.instance.info: [cloud_mem used_size: %d]\n", cloud_mem->used_size);
+	int	i, lastcheck, lastaccess, instances_num, metric_infos_num;
+	md5_byte_t	digest[MD5_DIGEST_SIZE];
+	char	*url, *key, *driver, *provider;
+	zbx_deltacloud_service_t	service_local, *service;
+
+	if (SUCCEED != cloud_snapshot_get(snapshot, digest, MD5_DIGEST_SIZE) ||
+			SUCCEED != cloud_snapshot_get_str(snapshot, &url) ||
+			SUCCEED != cloud_snapshot_get_str(snapshot, &key) ||
+			SUCCEED != cloud_snapshot_get_str(snapshot, &driver) ||
+			SUCCEED != cloud_snapshot_get_str(snapshot, &provider) ||
+			SUCCEED != cloud_snapshot_get_int(snapshot, &lastcheck) ||
+			SUCCEED != cloud_snapshot_get_int(snapshot, &lastaccess))
+	{
+		return FAIL;
+	}
 
-	int	i;
-	char	*url;
-	char	*key;
-	char	*secret;
-	char	*driver;
-	char	*provider;
-	char	*instance_id;
-	char	*element;
-	
-	zbx_deltacloud_service_t	*service = NULL;
+	memcpy(service_local.digest, digest, MD5_DIGEST_SIZE);
 
-	if (request->nparam != 7)
+	if (NULL == url || NULL == key || NULL == driver || NULL == provider ||
+			NULL != zbx_hashset_search(&deltacloud->services, &service_local))
 	{
-		/* set optional error message */
-		SET_MSG_RESULT(result, strdup("Invalid number of parameters e.g.) cloud.instane.info[url, key, secret, driver, provider, instance_id, element]"));
-		return SYSINFO_RET_FAIL;
+		return FAIL;
 	}
-	url = get_rparam(request, 0);
-	key = get_rparam(request, 1);
-	secret = get_rparam(request, 2);
-	driver = get_rparam(request, 3);
-	provider = get_rparam(request, 4);
-	instance_id = get_rparam(request, 5);
-	element = get_rparam(request, 6);
 
-	service = zbx_deltacloud_get_service(url, key, secret, driver, provider);
+	service = cloud_service_create(digest, url, key, driver, provider);
+	service->lastcheck = lastcheck;
+	service->lastaccess = lastaccess;
+	/* spread the first refreshes instead of fetching every account at once */
+	service->nextcheck = cloud_nextcheck(now, CONFIG_MODULE_INSTANCE_REFRESH, service->jitter);
 
-	if (service == NULL)
+	if (SUCCEED != cloud_snapshot_get_int(snapshot, &instances_num))
+		return FAIL;
+
+	for (i = 0; i < instances_num; i++)
 	{
-		SET_MSG_RESULT(result, strdup("No Data"));
-		return SYSINFO_RET_FAIL;
+		if (SUCCEED != cloud_snapshot_load_instance(snapshot, service, now))
+			return FAIL;
 	}
-	
-	for (i = 0; i < service->instances.values_num; i++)
+
+	if (0 != service->lastcheck)
+		cloud_instance_lld_update(service);
+
+	if (SUCCEED != cloud_snapshot_get_int(snapshot, &metric_infos_num))
+		return FAIL;
+
+	for (i = 0; i < metric_infos_num; i++)
 	{
-		zbx_deltacloud_instance_t *instance = service->instances.values[i];
-		if (NULL == instance)
-			break;
-		if (0 == strcmp(instance->id, instance_id))
-		{
-			if (0 == strcmp(element, "state"))
-				SET_STR_RESULT(result, strdup(instance->state));
-			else if (0 == strcmp(element, "owner_id"))
-				SET_STR_RESULT(result, strdup(instance->owner_id));
-			else if (0 == strcmp(element, "image_id"))
-				SET_STR_RESULT(result, strdup(instance->image_id));
-			else if (0 == strcmp(element, "image_href"))
-				SET_STR_RESULT(result, strdup(instance->image_href));
-			else if (0 == strcmp(element, "realm_id"))
-				SET_STR_RESULT(result, strdup(instance->realm_id));
-			else if (0 == strcmp(element, "realm_href"))
-				SET_STR_RESULT(result, strdup(instance->realm_href));
-			else if (0 == strcmp(element, "launch_time"))
-				SET_STR_RESULT(result, strdup(instance->launch_time));
-			else if (0 == strcmp(element, "hwp_href"))
-				SET_STR_RESULT(result, strdup(instance->hwp->href));
-			else if (0 == strcmp(element, "hwp_id"))
-				SET_STR_RESULT(result, strdup(instance->hwp->id));
-			else if (0 == strcmp(element, "hwp_name"))
-				SET_STR_RESULT(result, strdup(instance->hwp->name));
-			else{
-				SET_MSG_RESULT(result, strdup("Unsupported element"));
-				return SYSINFO_RET_FAIL;
-			}
-			return SYSINFO_RET_OK;
-		}
+		if (SUCCEED != cloud_snapshot_load_metric_info(snapshot, service, now))
+			return FAIL;
 	}
-	zabbix_log(LOG_LEVEL_ERR, "Finish cloud.instance.info: [cloud_mem used_size: %d]\n", cloud_mem->used_size);
-	SET_MSG_RESULT(result, strdup("Not match data"));
-	return SYSINFO_RET_FAIL;
+
+	return SUCCEED;
 }
 
-int	zbx_module_cloud_metric_discovery(AGENT_REQUEST *request, AGENT_RESULT *result)
+/******************************************************************************
+ *                                                                            *
+ * Function: cloud_snapshot_load                                              *
+ *                                                                            *
+ * Purpose: fill the empty cloud cache from ModuleSnapshotFile, so items have *
+ *          data right after a restart                                        *
+ *                                                                            *
+ * Comment: called from zbx_module_init() before the collectors are forked,   *
+ *          no lock is needed. A damaged snapshot is ignored as a whole.      *
+ *                                                                            *
+ ******************************************************************************/
+static void	cloud_snapshot_load(int now)
 {
+	zbx_cloud_snapshot_t	snapshot;
+	zbx_hashset_iter_t	iter;
+	zbx_deltacloud_service_t	*service;
+	struct stat	st;
+	char	magic[sizeof(SNAPSHOT_MAGIC) - 1];
+	int	i, fd, version, services_num, ret = FAIL;
 
-	zabbix_log(LOG_LEVEL_ERR, "Start cloud.metric.discovery: [cloud_mem used_size: %d]\n", cloud_mem->used_size);
-	struct zbx_json json;
-	int	i;
-	char	*url;
-	char	*key;
-	char	*secret;
-	char	*driver;
-	char	*provider;
-	char	*instance_id;
-	
-	zbx_deltacloud_service_t	*service = NULL;
-	zbx_deltacloud_metric_info_t	*metric_info = NULL;
+	if (NULL == CONFIG_MODULE_SNAPSHOT_FILE)
+		return;
 
-	if (request->nparam != 6)
+	if (-1 == (fd = open(CONFIG_MODULE_SNAPSHOT_FILE, O_RDONLY)))
 	{
-		/* set optional error message */
-		SET_MSG_RESULT(result, strdup("Invalid number of parameters e.g.) cloud.metric.discovery[url, key, secret, driver, provider, instance_id]"));
-		return SYSINFO_RET_FAIL;
+		if (ENOENT != errno)
+		{
+			zabbix_log(LOG_LEVEL_WARNING, "cannot open cloud cache snapshot \"%s\": %s",
+					CONFIG_MODULE_SNAPSHOT_FILE, zbx_strerror(errno));
+		}
+		return;
 	}
-	url = get_rparam(request, 0);
-	key = get_rparam(request, 1);
-	secret = get_rparam(request, 2);
-	driver = get_rparam(request, 3);
-	provider = get_rparam(request, 4);
-	instance_id = get_rparam(request, 5);
 
-	service = zbx_deltacloud_get_service(url, key, secret, driver, provider);
-	if (service == NULL)
-	{ SET_MSG_RESULT(result, strdup("No Data"));
-		return SYSINFO_RET_FAIL;
-	}
-        
-	for (i = 0; i < service->metric_infos.values_num; i++)
+	if (0 != fstat(fd, &st) || 0 == st.st_size)
 	{
-		metric_info = service->metric_infos.values[i];
-		if (NULL == metric_info)
-			break;
-		if (0 == strcmp(metric_info->instance_id, instance_id))
-			break;
-		metric_info = NULL;
+		close(fd);
+		return;
 	}
-        if (metric_info == NULL)
-        {
-		/* init metric_info */
-		metric_info = __cloud_mem_malloc_func(NULL, sizeof(zbx_deltacloud_metric_info_t));
-		CLOUD_VECTOR_CREATE(&metric_info->metrics, ptr);
-		metric_info->instance_id = cloud_shared_strdup(instance_id);
-        } 
 
+	/* running out of cloud_mem is fatal, the cached objects take a few times the size of the file */
+	if ((zbx_uint64_t)st.st_size * 4 > cloud_mem->free_size)
+	{
+		zabbix_log(LOG_LEVEL_WARNING, "cloud cache snapshot \"%s\" is too large for ModuleCloudCacheSize,"
+				" ignoring it", CONFIG_MODULE_SNAPSHOT_FILE);
+		close(fd);
+		return;
+	}
 
-/* metric monitoring */
-	zbx_deltacloud_metric_t *deltacloud_metric = NULL;
-	zbx_deltacloud_metric_value_t *metric_value = NULL;
-
-	struct deltacloud_api api;
-	struct deltacloud_metric *metric = NULL;
-	struct deltacloud_metric *start_ptr = NULL;
-
-	int rc;
-
-	rc = deltacloud_initialize(&api, url, key, secret, driver, provider);
-
-	deltacloud_get_metrics_by_instance_id(&api, instance_id, &metric);
-
-	/* clean metrics info */
-	/* ToDo: need to implement the feature to clear metrics for not exsited instance */
-
-	zbx_vector_ptr_clean(&metric_info->metrics, (zbx_mem_free_func_t)cloud_metric_shared_free);
-	if (rc == -1 || metric == NULL)
+	if (MAP_FAILED == (snapshot.data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)))
 	{
-		SET_MSG_RESULT(result, strdup("No Data"));
-		return SYSINFO_RET_FAIL;
+		zabbix_log(LOG_LEVEL_WARNING, "cannot map cloud cache snapshot \"%s\": %s",
+				CONFIG_MODULE_SNAPSHOT_FILE, zbx_strerror(errno));
+		close(fd);
+		return;
 	}
-	start_ptr = metric;
 
+	snapshot.size = st.st_size;
+	snapshot.offset = 0;
 
-	while(1)
+	if (SUCCEED == cloud_snapshot_get(&snapshot, magic, sizeof(magic)) &&
+			0 == memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic)) &&
+			SUCCEED == cloud_snapshot_get_int(&snapshot, &version) && SNAPSHOT_VERSION == version &&
+			SUCCEED == cloud_snapshot_get_int(&snapshot, &services_num))
 	{
-		deltacloud_metric = __cloud_mem_malloc_func(NULL, sizeof(zbx_deltacloud_metric_t));
-
-		if (NULL != metric->name)
-			deltacloud_metric->name = cloud_shared_strdup(metric->name);
-		else
-			deltacloud_metric->name = NULL;
-		if (NULL != metric->href)
-			deltacloud_metric->href = cloud_shared_strdup(metric->href);
-		else
-			deltacloud_metric->href = NULL;
-		deltacloud_metric->metric_value = __cloud_mem_malloc_func(NULL, sizeof(zbx_deltacloud_metric_value_t));
-
-		if (metric->values)
-		{
-			if(NULL != metric->values->unit)
-				deltacloud_metric->metric_value->unit = cloud_shared_strdup(metric->values->unit);
-			if(NULL != metric->values->minimum)
-				deltacloud_metric->metric_value->minimum = cloud_shared_strdup(metric->values->minimum);
-			if(NULL != metric->values->maximum)
-				deltacloud_metric->metric_value->maximum = cloud_shared_strdup(metric->values->maximum);
-			if(NULL != metric->values->samples)
-				deltacloud_metric->metric_value->samples = cloud_shared_strdup(metric->values->samples);
-			if(NULL != metric->values->average)
-				deltacloud_metric->metric_value->average = cloud_shared_strdup(metric->values->average);
-                }else{
-			deltacloud_metric->metric_value->unit = NULL;	
-			deltacloud_metric->metric_value->minimum = NULL;	
-			deltacloud_metric->metric_value->maximum = NULL;	
-			deltacloud_metric->metric_value->samples = NULL;	
-			deltacloud_metric->metric_value->average = NULL;	
+		for (i = 0; i < services_num; i++)
+		{
+			if (SUCCEED != cloud_snapshot_load_service(&snapshot, now))
+				break;
 		}
-		zbx_vector_ptr_append(&metric_info->metrics, deltacloud_metric);
 
-		metric = metric->next;
-
-		if (metric == NULL)
-			break;
+		if (i == services_num && snapshot.offset == snapshot.size)
+			ret = SUCCEED;
 	}
 
-	if (NULL != start_ptr)
-		deltacloud_free_metric_list(&start_ptr);
-	zbx_vector_ptr_append(&service->metric_infos, metric_info);
-
-		
-	// json format init
-	zbx_json_init(&json, ZBX_JSON_STAT_BUF_LEN);
-	// Add "data":[] for LLD format
-	zbx_json_addarray(&json, ZBX_PROTO_TAG_DATA);
-
+	munmap(snapshot.data, st.st_size);
+	close(fd);
 
-	for (i = 0; i < metric_info->metrics.values_num; i++)
+	if (SUCCEED != ret)
 	{
-		zbx_deltacloud_metric_t *metric = metric_info->metrics.values[i];
-		if (NULL == metric)
-		{
-			zbx_json_close(&json);
-			break;
-		}
-		zbx_json_addobject(&json, NULL);
-		if (NULL != metric->name)
+		zabbix_log(LOG_LEVEL_WARNING, "cloud cache snapshot \"%s\" is damaged or of another version,"
+				" ignoring it", CONFIG_MODULE_SNAPSHOT_FILE);
+
+		zbx_hashset_iter_reset(&deltacloud->services, &iter);
+		while (NULL != (service = zbx_hashset_iter_next(&iter)))
 		{
-			zbx_json_addstring(&json, METRIC_NAME_MACRO, metric->name, ZBX_JSON_TYPE_STRING);
-			if (NULL != metric->metric_value->unit)
-			{
-				zbx_json_addstring(&json, METRIC_UNIT_MACRO, metric->metric_value->unit, ZBX_JSON_TYPE_STRING);
-			}
-			zbx_json_close(&json);
+			cloud_service_shared_clean(service);
+			zbx_hashset_iter_remove(&iter);
 		}
+		return;
 	}
-	SET_STR_RESULT(result, strdup(json.buffer));
-	zbx_json_free(&json);
-	
-	zabbix_log(LOG_LEVEL_ERR, "Finish cloud.metric.discovery: [cloud_mem used_size: %d]\n", cloud_mem->used_size);
-	return SYSINFO_RET_OK;
+
+	zabbix_log(LOG_LEVEL_WARNING, "restored %d services from cloud cache snapshot \"%s\"", services_num,
+			CONFIG_MODULE_SNAPSHOT_FILE);
 }
 
-int	zbx_module_cloud_metric(AGENT_REQUEST *request, AGENT_RESULT *result)
+/******************************************************************************
+ *                                                                            *
+ * Function: cloud_collector_run                                              *
+ *                                                                            *
+ * Purpose: main loop of the collector process forked from zbx_module_init    *
+ *                                                                            *
+ * Comment: item callbacks only read cloud_mem, all Deltacloud requests are   *
+ *          made here. The process exits when the Zabbix parent goes away.    *
+ *                                                                            *
+ ******************************************************************************/
+static void	cloud_collector_run(pid_t parent_pid, int collector_num)
 {
-	zabbix_log(LOG_LEVEL_ERR, "Start cloud.metric: [cloud_mem used_size: %d]\n", cloud_mem->used_size);
-	int	i,j;
-	char	*url;
-	char	*key;
-	char	*secret;
-	char	*driver;
-	char	*provider;
-	char	*instance_id;
-	char	*metric_name;
-	char	*mode;
-	
-	zbx_deltacloud_service_t	*service = NULL;
+	int	now, housekeeping_nextcheck = 0, snapshot_nextcheck = time(NULL) + SNAPSHOT_PERIOD;
+	zbx_cloud_job_t	*job;
 
-	if (request->nparam != 8)
-	{
-		/* set optional error message */
-		SET_MSG_RESULT(result, strdup("Invalid number of parameters e.g.) cloud.instane.realm_id[url, key, secret, driver, provider, instance_id]"));
-		return SYSINFO_RET_FAIL;
-	}
-	url = get_rparam(request, 0);
-	key = get_rparam(request, 1);
-	secret = get_rparam(request, 2);
-	driver = get_rparam(request, 3);
-	provider = get_rparam(request, 4);
-	instance_id = get_rparam(request, 5);
-	metric_name = get_rparam(request, 6);
-	mode = get_rparam(request, 7);
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGINT, SIG_DFL);
+	signal(SIGCHLD, SIG_DFL);
 
-	service = zbx_deltacloud_get_service(url, key, secret, driver, provider);
+	sigaddset(&cloud_collector_sigmask, SIGTERM);
+	sigaddset(&cloud_collector_sigmask, SIGINT);
 
-	if (service == NULL)
-	{
-		SET_MSG_RESULT(result, strdup("No Data"));
-		return SYSINFO_RET_FAIL;
-	}
-	
-	for (i = 0; i < service->metric_infos.values_num; i++)
+	zbx_hashset_create(&cloud_apis, 10, cloud_api_hash_func, cloud_api_compare_func);
+
+	for (;;)
 	{
-		zbx_deltacloud_metric_info_t *metric_info = service->metric_infos.values[i];
-		if (metric_info == NULL)
+		if (parent_pid != getppid())
+			exit(SUCCEED);
+
+		now = time(NULL);
+
+		/* the cache is shared, one collector is enough to clean it */
+		if (1 == collector_num && housekeeping_nextcheck <= now)
 		{
-			SET_MSG_RESULT(result, strdup("No metric data"));
-			return SYSINFO_RET_FAIL;
+			cloud_collector_housekeeping(now);
+			housekeeping_nextcheck = now + HOUSEKEEPING_PERIOD;
 		}
-		if (0 == strcmp(metric_info->instance_id, instance_id))
+
+		if (1 == collector_num && snapshot_nextcheck <= now)
 		{
-			for (j = 0; metric_info->metrics.values_num; j++)
-			{
-				zbx_deltacloud_metric_t *metric = metric_info->metrics.values[j];
-				if (metric == NULL)
-				{
-					SET_MSG_RESULT(result, strdup("No metric"));
-					return SYSINFO_RET_FAIL;
-				}
-				if (NULL != metric->name && 0 == strcmp(metric->name, metric_name))
-				{
-					if (NULL == metric->metric_value)
-					{
-						SET_MSG_RESULT(result, strdup("No metric value data"));
-						return SYSINFO_RET_FAIL;
-					}
-
-					if (NULL != metric->metric_value->minimum && 0 == strcmp(mode, "minimum"))
-					{
-						SET_STR_RESULT(result, strdup(metric->metric_value->minimum));
-					}else if (NULL != metric->metric_value->maximum && 0 == strcmp(mode, "maximum"))
-					{
-						SET_STR_RESULT(result, strdup(metric->metric_value->maximum));
-					}else if (NULL != metric->metric_value->samples && 0 == strcmp(mode, "samples"))
-					{
-						SET_STR_RESULT(result, strdup(metric->metric_value->samples));
-					}else if (NULL != metric->metric_value->samples && 0 == strcmp(mode, "average"))
-					{
-						SET_STR_RESULT(result, strdup(metric->metric_value->average));
-					}else
-					{
-						SET_MSG_RESULT(result, strdup("Not match date mode"));
-						return SYSINFO_RET_FAIL;
-					}
-					return SYSINFO_RET_OK;
-				}			
-				metric = NULL;
-			}
-			return SYSINFO_RET_OK;
+			cloud_snapshot_write();
+			snapshot_nextcheck = now + SNAPSHOT_PERIOD;
+		}
+
+		if (NULL != (job = cloud_collector_get_job(now)))
+		{
+			cloud_collector_refresh(job);
+			cloud_collector_release_job(job);
+			cloud_job_free(job);
+			continue;
 		}
+
+		zbx_setproctitle("cloud module collector #%d [idle 1 sec]", collector_num);
+		sleep(1);
 	}
-	zabbix_log(LOG_LEVEL_ERR, "Finish cloud.metric: [cloud_mem used_size: %d]\n", cloud_mem->used_size);
-	SET_MSG_RESULT(result, strdup("Not match data"));
-	return SYSINFO_RET_FAIL;
 }
 
 /******************************************************************************
@@ -736,8 +3516,18 @@ int	zbx_module_cloud_metric(AGENT_REQUEST *request, AGENT_RESULT *result)
 static void	zbx_module_set_defaults()
 {
 
+	int	size;
+
 	if (NULL == CONFIG_ZABBIX_FILE)
 		CONFIG_ZABBIX_FILE = zbx_strdup(CONFIG_ZABBIX_FILE, "/etc/zabbix/zabbix_server.conf");
+
+	/* the trace slot is taken from a wrapping 32-bit counter, which stays in step with the ring */
+	/* only when the ring size divides 2^32                                                     */
+	for (size = 1; size < CONFIG_MODULE_TRACE_SIZE; size <<= 1)
+		;
+
+	if (0 != CONFIG_MODULE_TRACE_SIZE)
+		CONFIG_MODULE_TRACE_SIZE = size;
 }
 /******************************************************************************
  *                                                                            *
@@ -758,6 +3548,15 @@ static void	zbx_module_load_config()
 		{"ModuleTimeout",	&CONFIG_MODULE_TIMEOUT,	TYPE_INT,	PARM_OPT,	1,	600},
 		{"ModuleCloudCacheSize",	&CONFIG_MODULE_CLOUD_CACHE_SIZE,	TYPE_UINT64,	PARM_OPT,	128 * ZBX_KIBIBYTE,	0x7fffffff},
 		{"ZabbixFile",	&CONFIG_ZABBIX_FILE,	TYPE_STRING,	PARM_OPT,	0,	0},
+		{"ModuleInstanceRefresh",	&CONFIG_MODULE_INSTANCE_REFRESH,	TYPE_INT,	PARM_OPT,	60,	SEC_PER_DAY},
+		{"ModuleMetricRefresh",	&CONFIG_MODULE_METRIC_REFRESH,	TYPE_INT,	PARM_OPT,	60,	SEC_PER_DAY},
+		{"ModuleMetricBatchSize",	&CONFIG_MODULE_METRIC_BATCH_SIZE,	TYPE_INT,	PARM_OPT,	1,	10000},
+		{"ModuleCacheExpire",	&CONFIG_MODULE_CACHE_EXPIRE,	TYPE_INT,	PARM_OPT,	600,	30 * SEC_PER_DAY},
+		{"ModuleCollectorForks",	&CONFIG_MODULE_COLLECTOR_FORKS,	TYPE_INT,	PARM_OPT,	1,	100},
+		{"ModuleEndpointCollectors",	&CONFIG_MODULE_ENDPOINT_COLLECTORS,	TYPE_INT,	PARM_OPT,	1,	100},
+		{"ModuleSnapshotFile",	&CONFIG_MODULE_SNAPSHOT_FILE,	TYPE_STRING,	PARM_OPT,	0,	0},
+		{"ModuleTraceSize",	&CONFIG_MODULE_TRACE_SIZE,	TYPE_INT,	PARM_OPT,	0,	1000000},
+		{"ModuleTraceSampling",	&CONFIG_MODULE_TRACE_SAMPLING,	TYPE_INT,	PARM_OPT,	1,	10000},
 	};
 
 	parse_cfg_file(CONFIG_FILE, cfg, ZBX_CFG_FILE_REQUIRED, ZBX_CFG_STRICT);
@@ -780,111 +3579,114 @@ int	zbx_module_init()
 {
 	/* initialization for dummy.random */
 	srand(time(NULL));
+	cloud_secret_pad_init();
+	sigemptyset(&cloud_collector_sigmask);
 	zbx_module_load_config();
 	zbx_module_set_defaults();
 
 	key_t shm_key;
+	pid_t parent_pid;
+	int i;
 	shm_key = zbx_ftok(CONFIG_FILE, ZBX_IPC_CLOUD_ID);
 	
 	zbx_mem_create(&cloud_mem, shm_key, ZBX_NO_MUTEX, CONFIG_MODULE_CLOUD_CACHE_SIZE, "cloud cache size", "CloudCacheSize", 0);
 
+	/* cloud_mem is locked by the module itself, see cloud_rdlock() and cloud_wrlock() */
+	if (-1 == (cloud_lock_id = semget(IPC_PRIVATE, CLOUD_SEM_COUNT, 0600)))
+	{
+		zabbix_log(LOG_LEVEL_CRIT, "cannot create semaphore for cloud cache: %s", zbx_strerror(errno));
+		return ZBX_MODULE_FAIL;
+	}
+
 	deltacloud = __cloud_mem_malloc_func(NULL, sizeof(zbx_deltacloud_t));	
 	memset(deltacloud, 0, sizeof(zbx_deltacloud_t));
 
-	CLOUD_VECTOR_CREATE(&deltacloud->services, ptr);
+	zbx_hashset_create_ext(&deltacloud->services, 0, cloud_service_hash_func, cloud_service_compare_func,
+			__cloud_mem_malloc_func, __cloud_mem_realloc_func, __cloud_mem_free_func);
+	CLOUD_VECTOR_CREATE(&deltacloud->units, ptr);
+	zbx_hashset_create_ext(&deltacloud->strpool, 100, cloud_strpool_hash_func, cloud_strpool_compare_func,
+			__cloud_mem_malloc_func, __cloud_mem_realloc_func, __cloud_mem_free_func);
 
-	return ZBX_MODULE_OK;
-}
+	/* the trace must not take the room of the cached data */
+	if (CONFIG_MODULE_TRACE_SIZE * sizeof(zbx_cloud_trace_event_t) > cloud_mem->free_size / 4)
+	{
+		zabbix_log(LOG_LEVEL_WARNING, "ModuleTraceSize is too large for ModuleCloudCacheSize, tracing is disabled");
+		CONFIG_MODULE_TRACE_SIZE = 0;
+	}
 
-static void	cloud_address_shared_free(zbx_deltacloud_address_t *address)
-{
-	if (NULL != address->address)
-		__cloud_mem_free_func(address->address);
-	__cloud_mem_free_func(address);
-}
+	if (0 != CONFIG_MODULE_TRACE_SIZE)
+	{
+		deltacloud->trace = __cloud_mem_malloc_func(NULL,
+				CONFIG_MODULE_TRACE_SIZE * sizeof(zbx_cloud_trace_event_t));
+		memset(deltacloud->trace, 0, CONFIG_MODULE_TRACE_SIZE * sizeof(zbx_cloud_trace_event_t));
+	}
 
-static void	cloud_hardware_profile_shared_free(zbx_deltacloud_hardware_profile_t *hwp)
-{
-	if (NULL != hwp->href)
-		__cloud_mem_free_func(hwp->href);
-	if (NULL != hwp->id)
-		__cloud_mem_free_func(hwp->id);
-	if (NULL != hwp->name)
-		__cloud_mem_free_func(hwp->name);
-	__cloud_mem_free_func(hwp);
-}
+	cloud_snapshot_load(time(NULL));
 
-static void	cloud_metric_value_shared_free(zbx_deltacloud_metric_value_t *value)
-{
-	if (NULL != value)
+	/* pollers are forked later by Zabbix and inherit both cloud_mem and the semaphore */
+	parent_pid = getpid();
+
+	cloud_collector_pids = zbx_calloc(NULL, CONFIG_MODULE_COLLECTOR_FORKS, sizeof(pid_t));
+
+	/* services are refreshed in parallel, each collector claims one service at a time */
+	for (i = 0; i < CONFIG_MODULE_COLLECTOR_FORKS; i++)
 	{
-		if (NULL != value->minimum)
-			__cloud_mem_free_func(value->minimum);
-		if (NULL != value->maximum)
-			__cloud_mem_free_func(value->maximum);
-		if (NULL != value->samples)
-			__cloud_mem_free_func(value->samples);
-		if (NULL != value->average)
-			__cloud_mem_free_func(value->average);
-		if (NULL != value->unit)
-			__cloud_mem_free_func(value->unit);
-		__cloud_mem_free_func(value);
+		if (-1 == (cloud_collector_pids[i] = fork()))
+		{
+			zabbix_log(LOG_LEVEL_CRIT, "cannot fork cloud module collector: %s", zbx_strerror(errno));
+			return ZBX_MODULE_FAIL;
+		}
+		else if (0 == cloud_collector_pids[i])
+		{
+			cloud_collector_run(parent_pid, i + 1);
+			exit(SUCCEED);
+		}
 	}
+
+	return ZBX_MODULE_OK;
+}
+
+static void	cloud_hardware_profile_shared_clean(zbx_deltacloud_hardware_profile_t *hwp)
+{
+	cloud_strpool_release(hwp->href);
+	cloud_strpool_release(hwp->id);
+	cloud_strpool_release(hwp->name);
 }
 
 static void	cloud_metric_shared_free(zbx_deltacloud_metric_t *metric)
 {
-	if (NULL != metric->metric_value)
-		cloud_metric_value_shared_free(metric->metric_value);
-	if (NULL != metric->href)
-		__cloud_mem_free_func(metric->href);
-	if (NULL != metric->name)
-		__cloud_mem_free_func(metric->name);
+	cloud_strpool_release(metric->name);
 	__cloud_mem_free_func(metric);
 }
 
 static void	cloud_instance_shared_free(zbx_deltacloud_instance_t *instance)
 {
-	if (NULL != instance->href)
-		__cloud_mem_free_func(instance->href);
-	if (NULL != instance->id)
-		__cloud_mem_free_func(instance->id);
-	if (NULL != instance->name)
-		__cloud_mem_free_func(instance->name);
-	if (NULL != instance->owner_id)
-		__cloud_mem_free_func(instance->owner_id);
-	if (NULL != instance->image_id)
-		__cloud_mem_free_func(instance->image_id);
-	if (NULL != instance->image_href)
-		__cloud_mem_free_func(instance->image_href);
-	if (NULL != instance->realm_id)
-		__cloud_mem_free_func(instance->realm_id);
-	if (NULL != instance->realm_href)
-		__cloud_mem_free_func(instance->realm_href);
-	if (NULL != instance->state)
-		__cloud_mem_free_func(instance->state);
-	if (NULL != instance->launch_time)
-		__cloud_mem_free_func(instance->launch_time);
-	zbx_vector_ptr_clean(&instance->public_addresses, (zbx_mem_free_func_t)cloud_address_shared_free);
-	zbx_vector_ptr_clean(&instance->private_addresses, (zbx_mem_free_func_t)cloud_address_shared_free);
-	
-	zbx_vector_ptr_destroy(&instance->public_addresses);
-	zbx_vector_ptr_destroy(&instance->private_addresses);
-	cloud_hardware_profile_shared_free(instance->hwp);
+	cloud_strpool_release(instance->owner_id);
+	cloud_strpool_release(instance->image_id);
+	cloud_strpool_release(instance->image_href);
+	cloud_strpool_release(instance->realm_id);
+	cloud_strpool_release(instance->realm_href);
+	cloud_strpool_release(instance->state);
+	cloud_hardware_profile_shared_clean(&instance->hwp);
 	__cloud_mem_free_func(instance);
 }
 
-static void	cloud_metric_info_shared_free(zbx_deltacloud_metric_info_t *metric_info)
+static void	cloud_metric_info_shared_clean(zbx_deltacloud_metric_info_t *metric_info)
 {
 	if (NULL != metric_info->instance_id)
 		__cloud_mem_free_func(metric_info->instance_id);
+	if (NULL != metric_info->lld)
+		__cloud_mem_free_func(metric_info->lld);
+	zbx_hashset_destroy(&metric_info->metrics_index);
 	zbx_vector_ptr_clean(&metric_info->metrics, (zbx_mem_free_func_t)cloud_metric_shared_free);
 	zbx_vector_ptr_destroy(&metric_info->metrics);
-	__cloud_mem_free_func(metric_info);
 }
 
-static void	cloud_service_shared_free(zbx_deltacloud_service_t *service)
+static void	cloud_service_shared_clean(zbx_deltacloud_service_t *service)
 {
+	zbx_hashset_iter_t		iter;
+	zbx_deltacloud_metric_info_t	*metric_info;
+
 	if (NULL != service->url)
 		__cloud_mem_free_func(service->url);
 	if (NULL != service->key)
@@ -895,12 +3697,17 @@ static void	cloud_service_shared_free(zbx_deltacloud_service_t *service)
 		__cloud_mem_free_func(service->driver);
 	if (NULL != service->provider)
 		__cloud_mem_free_func(service->provider);
+	if (NULL != service->lld)
+		__cloud_mem_free_func(service->lld);
 
+	zbx_hashset_destroy(&service->instances_index);
 	zbx_vector_ptr_clean(&service->instances, (zbx_mem_free_func_t)cloud_instance_shared_free);
 	zbx_vector_ptr_destroy(&service->instances);
-	zbx_vector_ptr_clean(&service->metric_infos, (zbx_mem_free_func_t)cloud_metric_info_shared_free);
-	zbx_vector_ptr_destroy(&service->metric_infos);
-	__cloud_mem_free_func(service);
+
+	zbx_hashset_iter_reset(&service->metric_infos, &iter);
+	while (NULL != (metric_info = zbx_hashset_iter_next(&iter)))
+		cloud_metric_info_shared_clean(metric_info);
+	zbx_hashset_destroy(&service->metric_infos);
 }
 
 /******************************************************************************
@@ -916,13 +3723,49 @@ static void	cloud_service_shared_free(zbx_deltacloud_service_t *service)
  ******************************************************************************/
 int	zbx_module_uninit()
 {
+	int	i;
+
+	if (NULL != cloud_collector_pids)
+	{
+		for (i = 0; i < CONFIG_MODULE_COLLECTOR_FORKS; i++)
+		{
+			if (0 < cloud_collector_pids[i])
+				kill(cloud_collector_pids[i], SIGTERM);
+		}
+
+		for (i = 0; i < CONFIG_MODULE_COLLECTOR_FORKS; i++)
+		{
+			if (0 < cloud_collector_pids[i])
+				waitpid(cloud_collector_pids[i], NULL, 0);
+		}
+
+		zbx_free(cloud_collector_pids);
+	}
+
+	/* the collectors are gone, the snapshot has the final state of the cache */
+	if (NULL != deltacloud)
+		cloud_snapshot_write();
+
+	if (-1 != cloud_lock_id)
+		semctl(cloud_lock_id, 0, IPC_RMID, 0);
+
 	if (NULL != deltacloud)
 	{
-		zbx_vector_ptr_clean(&deltacloud->services, (zbx_mem_free_func_t)cloud_service_shared_free);
-		zbx_vector_ptr_destroy(&deltacloud->services);
+		zbx_hashset_iter_t	iter;
+		zbx_deltacloud_service_t	*service;
+
+		zbx_hashset_iter_reset(&deltacloud->services, &iter);
+		while (NULL != (service = zbx_hashset_iter_next(&iter)))
+			cloud_service_shared_clean(service);
+		zbx_hashset_destroy(&deltacloud->services);
+		zbx_vector_ptr_clean(&deltacloud->units, __cloud_mem_free_func);
+		zbx_vector_ptr_destroy(&deltacloud->units);
+		zbx_hashset_destroy(&deltacloud->strpool);
+		if (NULL != deltacloud->trace)
+			__cloud_mem_free_func(deltacloud->trace);
 		__cloud_mem_free_func(deltacloud);
 	}
-	zabbix_log(LOG_LEVEL_ERR, "Clean cloud mem: [used_size: %d]\n", cloud_mem->used_size);
+	zabbix_log(LOG_LEVEL_ERR, "Clean cloud mem: [used_size: " ZBX_FS_UI64 "]\n", cloud_mem->used_size);
 	zbx_mem_destroy(cloud_mem);
 
 	return ZBX_MODULE_OK;